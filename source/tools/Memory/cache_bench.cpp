@@ -0,0 +1,725 @@
+/*BEGIN_LEGAL 
+Intel Open Source License 
+
+Copyright (c) 2002-2017 Intel Corporation. All rights reserved.
+ 
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.  Redistributions
+in binary form must reproduce the above copyright notice, this list of
+conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.  Neither the name of
+the Intel Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without
+specific prior written permission.
+ 
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE INTEL OR
+ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+END_LEGAL */
+/*! @file
+ *  Microbenchmark and regression check of the cache.H kernels, built like
+ *  icache_replay against the Pin type shim:
+ *
+ *    g++ -O2 -o cache_bench cache_bench.cpp
+ *
+ *  Every kernel is driven by synthetic fetch streams over a matrix of set
+ *  counts and associativities. Each run reports its miss count, the best
+ *  time of -repeat runs, accesses per second and time per access. With the
+ *  default streams and lengths the miss counts are compared with known-good
+ *  values, and any difference makes the exit status 1. The check also
+ *  counts the lines every fetch size misses on lines of each size down
+ *  to the smallest the simulator takes, and replays a fetch stream with
+ *  prefetches that arrive at once and ones that never do.
+ */
+
+#include "pin_shim.H"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "cache.H"
+#include "icache_sim.H"
+#include "stack_distance.H"
+#include "stats_writer.H"
+
+using std::cerr;
+using std::endl;
+
+#define BENCH_LINE_SIZE 64
+#define BENCH_MAX_SETS (KILO*8)
+#define BENCH_MAX_ASSOCIATIVITY 256
+//start of the synthetic code, away from address 0 which marks empty ways
+#define BENCH_CODE_BASE 0x400000
+
+typedef CACHE_ROUND_ROBIN_REPLACEMENT(BENCH_MAX_SETS, BENCH_MAX_ASSOCIATIVITY, LRU_STACK,
+                                      CACHE_ALLOC::STORE_ALLOCATE) BENCH_CACHE;
+typedef CACHE_MODIFIED_CACHE_REPLACEMENT(BENCH_MAX_SETS, BENCH_MAX_ASSOCIATIVITY, LRU_STACK,
+                                         CACHE_ALLOC::STORE_ALLOCATE) BENCH_MODIFIED_CACHE;
+typedef CACHE_MODIFIED_CACHE_REPLACEMENT(BENCH_MAX_SETS, BENCH_MAX_ASSOCIATIVITY, TREE_PLRU,
+                                         CACHE_ALLOC::STORE_ALLOCATE) BENCH_MODIFIED_PLRU_CACHE;
+
+typedef enum
+{
+    KERNEL_ACCESS,          // CACHE::Access
+    KERNEL_SINGLE_LINE,     // CACHE::AccessSingleLine
+    KERNEL_SELECTIVE,       // CACHE::AccessSingleLine_selective_allocate
+    KERNEL_MODIFIED,        // Access_selective_allocate of a MODIFIED_CACHE
+    KERNEL_MODIFIED_PLRU,   // the same with tree pseudo-LRU replacement
+    KERNEL_NUM
+} BENCH_KERNEL;
+
+static const char * const kernel_names[KERNEL_NUM] = {
+    "access", "single_line", "selective", "modified", "modified_plru"
+};
+
+//degree of use of the function of an access, for the selective kernels
+typedef enum
+{
+    USE_LOW,
+    USE_MEDIUM,
+    USE_HIGH
+} BENCH_USE;
+
+struct bench_access{
+	ADDRINT addr;
+	UINT8 size;
+	UINT8 use;
+};
+
+/*!
+ *  @brief xorshift64* generator, so that the streams and with them the
+ *  known-good miss counts are the same on every host
+ */
+class BENCH_RANDOM
+{
+  private:
+    UINT64 _state;
+
+  public:
+    BENCH_RANDOM(UINT64 seed) : _state(seed ? seed : 1) {}
+
+    UINT64 Next()
+    {
+        _state ^= _state >> 12;
+        _state ^= _state << 25;
+        _state ^= _state >> 27;
+        return _state * 2685821657736338717ULL;
+    }
+
+    /// @return a number in [low, high]
+    UINT32 Range(UINT32 low, UINT32 high) { return low + Next() % (high - low + 1); }
+    /// @return a number in [0, 1)
+    double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); }
+
+    /// @return a length of an x86 instruction, mostly short
+    UINT8 InstructionSize() { return (Next() % 16) ? Range(1, 7) : Range(8, 15); }
+};
+
+struct bench_options{
+	string output;
+	STATS_WRITER::FORMAT format;
+	UINT64 accesses;
+	UINT32 repeat;
+	string streams;
+	string kernels;
+	string loop_kb;
+	UINT32 functions;
+	double zipf_s;
+	string associativities;
+	string sets;
+	UINT64 seed;
+	bool check;
+	//set when an option changes the streams, which have known-good miss
+	//counts only in their default form
+	bool default_streams;
+};
+
+/* ===================================================================== */
+/* Streams */
+/* ===================================================================== */
+
+// straight-line code that never returns to a line
+static void SequentialStream(const bench_options & opts, std::vector<bench_access> & stream)
+{
+    BENCH_RANDOM random(opts.seed);
+    ADDRINT addr = BENCH_CODE_BASE;
+    for (UINT64 i = 0; i < opts.accesses; i++){
+        const bench_access access = { addr, random.InstructionSize(), USE_HIGH };
+        stream.push_back(access);
+        addr += access.size;
+    }
+}
+
+// a loop over kb kilobytes of straight-line code
+static void LoopStream(const bench_options & opts, UINT32 kb, std::vector<bench_access> & stream)
+{
+    BENCH_RANDOM random(opts.seed);
+    const ADDRINT end = BENCH_CODE_BASE + kb * KILO;
+    ADDRINT addr = BENCH_CODE_BASE;
+    for (UINT64 i = 0; i < opts.accesses; i++){
+        const bench_access access = { addr, random.InstructionSize(), USE_HIGH };
+        stream.push_back(access);
+        addr += access.size;
+        if (addr >= end)
+            addr = BENCH_CODE_BASE;
+    }
+}
+
+// calls into functions of 64 bytes to 4 kilobytes picked with a Zipf
+// distribution of exponent zipf_s, each running 8 to 64 instructions from its
+// entry. The hottest 1/32 of the functions are of high use, the next 3/32
+// of medium use.
+static void ZipfStream(const bench_options & opts, std::vector<bench_access> & stream)
+{
+    BENCH_RANDOM random(opts.seed);
+    std::vector<ADDRINT> entries(opts.functions);
+    std::vector<ADDRINT> ends(opts.functions);
+    ADDRINT addr = BENCH_CODE_BASE;
+    for (UINT32 i = 0; i < opts.functions; i++){
+        entries[i] = addr;
+        ends[i] = addr + random.Range(64, 4096);
+        addr = (ends[i] + 15) & ~ADDRINT(15);
+    }
+    //function i of the list has rank i, the layout is not in rank order
+    for (UINT32 i = opts.functions - 1; i > 0; i--){
+        const UINT32 j = random.Range(0, i);
+        std::swap(entries[i], entries[j]);
+        std::swap(ends[i], ends[j]);
+    }
+
+    std::vector<double> cdf(opts.functions);
+    double sum = 0;
+    for (UINT32 i = 0; i < opts.functions; i++){
+        sum += 1.0 / pow(i + 1.0, opts.zipf_s);
+        cdf[i] = sum;
+    }
+
+    while (stream.size() < opts.accesses){
+        const UINT32 rank = std::lower_bound(cdf.begin(), cdf.end(), random.Uniform() * sum) - cdf.begin();
+        const UINT32 function = std::min(rank, opts.functions - 1);
+        const UINT8 use = (function < opts.functions / 32) ? USE_HIGH :
+                          (function < opts.functions / 8) ? USE_MEDIUM : USE_LOW;
+        const UINT32 length = random.Range(8, 64);
+        ADDRINT iaddr = entries[function];
+        for (UINT32 k = 0; k < length && iaddr < ends[function] && stream.size() < opts.accesses; k++){
+            const bench_access access = { iaddr, random.InstructionSize(), use };
+            stream.push_back(access);
+            iaddr += access.size;
+        }
+    }
+}
+
+// jumps to random instructions of 16 megabytes of code
+static void RandomStream(const bench_options & opts, std::vector<bench_access> & stream)
+{
+    BENCH_RANDOM random(opts.seed);
+    for (UINT64 i = 0; i < opts.accesses; i++){
+        const bench_access access = { BENCH_CODE_BASE + (random.Next() % (16 * MEGA)),
+                                      random.InstructionSize(), USE_HIGH };
+        stream.push_back(access);
+    }
+}
+
+/* ===================================================================== */
+/* Kernels */
+/* ===================================================================== */
+
+static UINT64 Nanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return UINT64(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+// feeds the stream through one kernel of cache
+// @return the time it took in nanoseconds
+template <class SIM>
+static UINT64 RunKernel(BENCH_KERNEL kernel, SIM & cache, const std::vector<bench_access> & stream)
+{
+    const CACHE_BASE::ACCESS_TYPE load = CACHE_BASE::ACCESS_TYPE_LOAD;
+    const bench_access * access = &stream[0];
+    const bench_access * end = access + stream.size();
+    const UINT64 start = Nanoseconds();
+    switch (kernel)
+    {
+      case KERNEL_ACCESS:
+        for (; access != end; access++)
+            cache.Access(access->addr, access->size, load);
+        break;
+      case KERNEL_SINGLE_LINE:
+        for (; access != end; access++)
+            cache.AccessSingleLine(access->addr, load);
+        break;
+      case KERNEL_SELECTIVE:
+        for (; access != end; access++)
+            cache.AccessSingleLine_selective_allocate(access->addr, load, true, access->use == USE_HIGH,
+                                                      access->use == USE_MEDIUM, false);
+        break;
+      default:
+        for (; access != end; access++)
+            cache.Access_selective_allocate(access->addr, access->size, load, true, access->use == USE_HIGH,
+                                            access->use == USE_MEDIUM, false);
+        break;
+    }
+    return Nanoseconds() - start;
+}
+
+// one run on a new cache of the given geometry
+// @return the time it took in nanoseconds
+static UINT64 RunOnce(BENCH_KERNEL kernel, UINT32 sets, UINT32 associativity,
+                      const std::vector<bench_access> & stream, CACHE_STATS & misses)
+{
+    const UINT32 size = sets * associativity * BENCH_LINE_SIZE;
+    UINT64 time;
+    if (kernel == KERNEL_MODIFIED){
+        BENCH_MODIFIED_CACHE cache("bench", size, BENCH_LINE_SIZE, associativity);
+        time = RunKernel(kernel, cache, stream);
+        misses = cache.Misses();
+    }
+    else if (kernel == KERNEL_MODIFIED_PLRU){
+        BENCH_MODIFIED_PLRU_CACHE cache("bench", size, BENCH_LINE_SIZE, associativity);
+        time = RunKernel(kernel, cache, stream);
+        misses = cache.Misses();
+    }
+    else {
+        BENCH_CACHE cache("bench", size, BENCH_LINE_SIZE, associativity);
+        time = RunKernel(kernel, cache, stream);
+        misses = cache.Misses();
+    }
+    return time;
+}
+
+/* ===================================================================== */
+/* Known-good miss counts */
+/* ===================================================================== */
+
+//misses of the default streams (-accesses 1000000 -seed 1 -loop_kb 32,256
+//-functions 2048 -zipf_s 1), for 2, 4, 8 and 16 ways
+struct bench_expected{
+	const char * stream;
+	const char * kernel;
+	UINT32 sets;
+	UINT64 misses[4];
+};
+
+static const UINT32 expected_associativities[] = { 2, 4, 8, 16 };
+
+static const bench_expected expected_misses[] = {
+    { "sequential", "access", 64, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "access", 512, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "single_line", 64, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "single_line", 512, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "selective", 64, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "selective", 512, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "modified", 64, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "modified", 512, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "modified_plru", 64, { 69740, 69740, 69740, 69740 } },
+    { "sequential", "modified_plru", 512, { 69740, 69740, 69740, 69740 } },
+    { "loop_32k", "access", 64, { 69843, 69843, 1487, 513 } },
+    { "loop_32k", "access", 512, { 513, 513, 513, 513 } },
+    { "loop_32k", "single_line", 64, { 69734, 69734, 512, 512 } },
+    { "loop_32k", "single_line", 512, { 512, 512, 512, 512 } },
+    { "loop_32k", "selective", 64, { 69734, 69734, 512, 512 } },
+    { "loop_32k", "selective", 512, { 512, 512, 512, 512 } },
+    { "loop_32k", "modified", 64, { 69843, 69843, 1487, 513 } },
+    { "loop_32k", "modified", 512, { 513, 513, 513, 513 } },
+    { "loop_32k", "modified_plru", 64, { 69843, 69843, 1487, 513 } },
+    { "loop_32k", "modified_plru", 512, { 513, 513, 513, 513 } },
+    { "loop_256k", "access", 64, { 69754, 69754, 69754, 69754 } },
+    { "loop_256k", "access", 512, { 69754, 69754, 4224, 4097 } },
+    { "loop_256k", "single_line", 64, { 69739, 69739, 69739, 69739 } },
+    { "loop_256k", "single_line", 512, { 69739, 69739, 4096, 4096 } },
+    { "loop_256k", "selective", 64, { 69739, 69739, 69739, 69739 } },
+    { "loop_256k", "selective", 512, { 69739, 69739, 4096, 4096 } },
+    { "loop_256k", "modified", 64, { 69754, 69754, 69754, 69754 } },
+    { "loop_256k", "modified", 512, { 69754, 69754, 4224, 4097 } },
+    { "loop_256k", "modified_plru", 64, { 69754, 69754, 69754, 69754 } },
+    { "loop_256k", "modified_plru", 512, { 69754, 69754, 4224, 4097 } },
+    { "zipf", "access", 64, { 66513, 56577, 46346, 35968 } },
+    { "zipf", "access", 512, { 39152, 27368, 16580, 9345 } },
+    { "zipf", "single_line", 64, { 65333, 55542, 45436, 35222 } },
+    { "zipf", "single_line", 512, { 38340, 26735, 16152, 9186 } },
+    { "zipf", "selective", 64, { 65333, 55542, 45436, 35222 } },
+    { "zipf", "selective", 512, { 38340, 26735, 16152, 9186 } },
+    { "zipf", "modified", 64, { 61494, 47967, 39916, 39567 } },
+    { "zipf", "modified", 512, { 38621, 35243, 35141, 35141 } },
+    { "zipf", "modified_plru", 64, { 61494, 49244, 40598, 37741 } },
+    { "zipf", "modified_plru", 512, { 38621, 34902, 34456, 34452 } },
+    { "random", "access", 64, { 999541, 999085, 998164, 996321 } },
+    { "random", "access", 512, { 996290, 992637, 985214, 970583 } },
+    { "random", "single_line", 64, { 999515, 999038, 998048, 996121 } },
+    { "random", "single_line", 512, { 996063, 992213, 984387, 968962 } },
+    { "random", "selective", 64, { 999515, 999038, 998048, 996121 } },
+    { "random", "selective", 512, { 996063, 992213, 984387, 968962 } },
+    { "random", "modified", 64, { 999541, 999085, 998164, 996321 } },
+    { "random", "modified", 512, { 996290, 992637, 985214, 970583 } },
+    { "random", "modified_plru", 64, { 999541, 999085, 998164, 996322 } },
+    { "random", "modified_plru", 512, { 996290, 992637, 985209, 970583 } },
+};
+
+// @return the known-good miss count of a run, 0 if there is none
+static UINT64 ExpectedMisses(const bench_options & opts, const string & stream, BENCH_KERNEL kernel,
+                             UINT32 sets, UINT32 associativity)
+{
+    if (!opts.default_streams)
+        return 0;
+    for (UINT32 i = 0; i < sizeof(expected_misses) / sizeof(expected_misses[0]); i++){
+        const bench_expected & expected = expected_misses[i];
+        if (stream != expected.stream || strcmp(kernel_names[kernel], expected.kernel) || sets != expected.sets)
+            continue;
+        for (UINT32 j = 0; j < 4; j++)
+            if (expected_associativities[j] == associativity)
+                return expected.misses[j];
+    }
+    return 0;
+}
+
+// every fetch size at every offset of a line, from the smallest lines on,
+// must miss once on each cold line it spans
+// @return the number of accesses whose missed lines differ
+static UINT32 CheckMissedLines(UINT32 & checked)
+{
+    const CACHE_BASE::ACCESS_TYPE load = CACHE_BASE::ACCESS_TYPE_LOAD;
+    UINT32 failures = 0;
+    for (UINT32 line_size = MIN_LINE_SIZE; line_size <= BENCH_LINE_SIZE; line_size *= 2){
+        BENCH_MODIFIED_CACHE cache("lines", 64 * 16 * line_size, line_size, 16);
+        //each access starts in lines no earlier access touched
+        ADDRINT region = BENCH_CODE_BASE;
+        for (UINT32 offset = 0; offset < line_size; offset++)
+        for (UINT32 size = 1; size <= MAX_FETCH_BYTES; size++){
+            const hit_and_use_information result =
+                cache.Access_selective_allocate(region + offset, size, load, true, true, false, false);
+            const UINT32 expected = (offset + size - 1) / line_size + 1;
+            checked++;
+            if (result.missed_lines != expected){
+                cerr << size << " bytes at offset " << offset << " of " << line_size << " byte lines: "
+                     << result.missed_lines << " missed lines, expected " << expected << endl;
+                failures++;
+            }
+            region += 2 * line_size + MAX_FETCH_BYTES / line_size * line_size;
+        }
+    }
+    return failures;
+}
+
+// IL1 misses and stall cycles of sequential fetches over code twice the
+// size of IL1 with the next-line prefetcher and the given latency
+static VOID ReplayPrefetches(UINT32 latency, CACHE_STATS & misses, UINT64 & stall)
+{
+    icache_config config;
+    config.il1_size = 32 * KILO;
+    config.il1_line_size = BENCH_LINE_SIZE;
+    config.il1_associativity = 8;
+    config.itlb_size = 32 * KILO;
+    config.itlb_line_size = BENCH_LINE_SIZE;
+    config.itlb_associativity = 8;
+    config.l2_size = 0;
+    config.l2_line_size = BENCH_LINE_SIZE;
+    config.l2_associativity = 8;
+    config.llc_size = 0;
+    config.llc_line_size = BENCH_LINE_SIZE;
+    config.llc_associativity = 16;
+    config.inclusion = INCLUSION_NON_INCLUSIVE;
+    config.tlb.page_size = PAGE_SIZE_4K;
+    config.tlb.itlb_entries = 0;
+    config.tlb.itlb_associativity = 8;
+    config.tlb.stlb_entries = 0;
+    config.tlb.stlb_associativity = 12;
+    config.tlb.stlb_latency = 9;
+    config.tlb.walk_level_latency = 8;
+    config.timing.enabled = true;
+    config.timing.latency[LOWER_LEVEL_L2] = 14;
+    config.timing.latency[LOWER_LEVEL_LLC] = 40;
+    config.timing.latency[LOWER_LEVEL_NUM] = 200;
+    config.timing.overlap_bbl = false;
+    config.prefetch.kind = PREFETCHER_NEXT_LINE;
+    config.prefetch.degree = 2;
+    config.prefetch.latency = latency;
+    config.sampling.period = 0;
+    config.sampling.warming = 0;
+    config.sampling.detailed = 0;
+    config.approximate_footprint = false;
+    config.symbol_functions = false;
+    config.call_stack_depth = 1024;
+    config.function_names = NULL;
+    config.profile_period = 0;
+
+    ICACHE_SIM sim(config);
+    for (UINT32 pass = 0; pass < 2; pass++)
+        for (ADDRINT addr = BENCH_CODE_BASE; addr < BENCH_CODE_BASE + 64 * KILO; addr += 4)
+            sim.Fetch(addr, 4, FETCH_KIND_PLAIN);
+    misses = sim.il1->Misses();
+    stall = sim.stall_cycles;
+}
+
+// prefetches that never arrive in time must not hide misses or stalls
+// @return the number of counts that did not grow with the latency
+static UINT32 CheckPrefetchLatency(UINT32 & checked)
+{
+    CACHE_STATS timely_misses, late_misses;
+    UINT64 timely_stall, late_stall;
+    ReplayPrefetches(0, timely_misses, timely_stall);
+    ReplayPrefetches(~UINT32(0), late_misses, late_stall);
+    checked += 2;
+    UINT32 failures = 0;
+    if (late_misses <= timely_misses){
+        cerr << "late prefetches: " << late_misses << " IL1 misses, timely ones: " << timely_misses << endl;
+        failures++;
+    }
+    if (late_stall <= timely_stall){
+        cerr << "late prefetches: " << late_stall << " stall cycles, timely ones: " << timely_stall << endl;
+        failures++;
+    }
+    return failures;
+}
+
+/* ===================================================================== */
+
+static int Usage(const char * prog)
+{
+    cerr << "usage: " << prog << " [options]\n"
+            "  -o <file>   output file (default cache_bench.out)\n"
+            "  -format <text|jsonl|csv|binary>  report format (default text)\n"
+            "  -accesses <n>  accesses of each stream (default 1000000)\n"
+            "  -repeat <n>  runs of each kernel, the fastest is reported (default 3)\n"
+            "  -streams <list>  of sequential, loop, zipf and random (default all)\n"
+            "  -kernels <list>  of access, single_line, selective, modified and modified_plru\n"
+            "                   (default all)\n"
+            "  -loop_kb <list>  working sets of the loop streams in kilobytes (default 32,256)\n"
+            "  -functions <n>  functions of the zipf stream (default 2048)\n"
+            "  -zipf_s <s>  exponent of the zipf stream (default 1)\n"
+            "  -a <list>   associativities (default 2,4,8,16)\n"
+            "  -sets <list>  set counts (default 64,512)\n"
+            "  -seed <n>   seed of the streams (default 1)\n"
+            "  -check <0|1>  compare miss counts with the known-good values (default 1)\n";
+    return 1;
+}
+
+static bool ParseOptions(int argc, char * argv[], bench_options & opts)
+{
+    opts.output = "cache_bench.out";
+    opts.format = STATS_WRITER::FORMAT_TEXT;
+    opts.accesses = 1000000;
+    opts.repeat = 3;
+    opts.streams = "sequential,loop,zipf,random";
+    opts.kernels = "access,single_line,selective,modified,modified_plru";
+    opts.loop_kb = "32,256";
+    opts.functions = 2048;
+    opts.zipf_s = 1.0;
+    opts.associativities = "2,4,8,16";
+    opts.sets = "64,512";
+    opts.seed = 1;
+    opts.check = true;
+    opts.default_streams = true;
+
+    for (int i = 1; i < argc; i++){
+        if (i + 1 >= argc)
+            return false;
+        const char * value = argv[i+1];
+        if (!strcmp(argv[i], "-o"))
+            opts.output = value;
+        else if (!strcmp(argv[i], "-format")){
+            if (!STATS_WRITER::ParseFormat(value, opts.format))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-accesses")){
+            opts.accesses = strtoull(value, NULL, 10);
+            opts.default_streams = false;
+        }
+        else if (!strcmp(argv[i], "-repeat"))
+            opts.repeat = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "-streams"))
+            opts.streams = value;
+        else if (!strcmp(argv[i], "-kernels"))
+            opts.kernels = value;
+        else if (!strcmp(argv[i], "-loop_kb"))
+            opts.loop_kb = value;
+        else if (!strcmp(argv[i], "-functions")){
+            opts.functions = strtoul(value, NULL, 10);
+            opts.default_streams = false;
+        }
+        else if (!strcmp(argv[i], "-zipf_s")){
+            opts.zipf_s = atof(value);
+            opts.default_streams = false;
+        }
+        else if (!strcmp(argv[i], "-a"))
+            opts.associativities = value;
+        else if (!strcmp(argv[i], "-sets"))
+            opts.sets = value;
+        else if (!strcmp(argv[i], "-seed")){
+            opts.seed = strtoull(value, NULL, 10);
+            opts.default_streams = false;
+        }
+        else if (!strcmp(argv[i], "-check"))
+            opts.check = atoi(value) != 0;
+        else
+            return false;
+        i++;
+    }
+    return opts.accesses != 0 && opts.repeat != 0 && opts.functions != 0;
+}
+
+// splits a comma separated list of names
+static std::vector<string> ParseNameList(const string & list)
+{
+    std::vector<string> names;
+    size_t start = 0;
+    while (start < list.size()){
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        if (end > start)
+            names.push_back(list.substr(start, end - start));
+        start = end + 1;
+    }
+    return names;
+}
+
+int main(int argc, char * argv[])
+{
+    bench_options opts;
+    if (!ParseOptions(argc, argv, opts))
+        return Usage(argv[0]);
+
+    std::vector<BENCH_KERNEL> kernels;
+    const std::vector<string> kernel_list = ParseNameList(opts.kernels);
+    for (UINT32 i = 0; i < kernel_list.size(); i++){
+        const char * const * name = std::find(kernel_names, kernel_names + KERNEL_NUM, kernel_list[i]);
+        if (name == kernel_names + KERNEL_NUM){
+            cerr << "Unknown kernel " << kernel_list[i] << endl;
+            return Usage(argv[0]);
+        }
+        kernels.push_back(BENCH_KERNEL(name - kernel_names));
+    }
+
+    const std::vector<UINT32> associativities = ParseNumberList(opts.associativities);
+    const std::vector<UINT32> set_counts = ParseNumberList(opts.sets);
+    for (UINT32 i = 0; i < associativities.size(); i++)
+        if (!IsPower2(associativities[i]) || associativities[i] > BENCH_MAX_ASSOCIATIVITY){
+            cerr << "Associativities must be powers of two of at most " << BENCH_MAX_ASSOCIATIVITY << endl;
+            return 1;
+        }
+    for (UINT32 i = 0; i < set_counts.size(); i++)
+        if (!IsPower2(set_counts[i]) || set_counts[i] > BENCH_MAX_SETS){
+            cerr << "Set counts must be powers of two of at most " << BENCH_MAX_SETS << endl;
+            return 1;
+        }
+
+    //the loop stream is named by its working set
+    std::vector<string> streams;
+    const std::vector<string> stream_list = ParseNameList(opts.streams);
+    const std::vector<UINT32> loop_kb = ParseNumberList(opts.loop_kb);
+    for (UINT32 i = 0; i < stream_list.size(); i++){
+        if (stream_list[i] == "loop"){
+            for (UINT32 j = 0; j < loop_kb.size(); j++)
+                streams.push_back("loop_" + decstr(loop_kb[j]) + "k");
+        }
+        else if (stream_list[i] == "sequential" || stream_list[i] == "zipf" || stream_list[i] == "random")
+            streams.push_back(stream_list[i]);
+        else {
+            cerr << "Unknown stream " << stream_list[i] << endl;
+            return Usage(argv[0]);
+        }
+    }
+
+    STATS_WRITER writer;
+    std::ofstream out;
+    static const char * const fields[] = {
+        "sets", "associativity", "accesses", "misses", "expected_misses",
+        "nanoseconds", "accesses_per_second", "ps_per_access"
+    };
+    if (opts.format != STATS_WRITER::FORMAT_TEXT){
+        if (!writer.Open(opts.output.c_str(), opts.format)){
+            cerr << "Could not open report " << opts.output << endl;
+            return 1;
+        }
+        writer.Section("cache_bench", true, fields, 8);
+    }
+    else {
+        out.open(opts.output.c_str());
+        out << "# stream/kernel            sets  ways      misses    expected   accesses/s   ns/access\n";
+    }
+
+    UINT32 failures = 0;
+    UINT32 checked = 0;
+    std::vector<bench_access> stream;
+    for (UINT32 s = 0; s < streams.size(); s++){
+        const string & name = streams[s];
+        stream.clear();
+        stream.reserve(opts.accesses);
+        if (name == "sequential")
+            SequentialStream(opts, stream);
+        else if (name == "zipf")
+            ZipfStream(opts, stream);
+        else if (name == "random")
+            RandomStream(opts, stream);
+        else
+            LoopStream(opts, strtoul(name.c_str() + strlen("loop_"), NULL, 10), stream);
+
+        for (UINT32 k = 0; k < kernels.size(); k++)
+        for (UINT32 i = 0; i < set_counts.size(); i++)
+        for (UINT32 j = 0; j < associativities.size(); j++){
+            CACHE_STATS misses = 0;
+            UINT64 best = ~UINT64(0);
+            for (UINT32 r = 0; r < opts.repeat; r++)
+                best = std::min(best, RunOnce(kernels[k], set_counts[i], associativities[j], stream, misses));
+            best = std::max<UINT64>(best, 1);
+
+            const UINT64 expected = ExpectedMisses(opts, name, kernels[k], set_counts[i], associativities[j]);
+            const bool failed = opts.check && expected != 0 && expected != misses;
+            checked += (opts.check && expected != 0);
+            failures += failed;
+            const string label = name + "/" + kernel_names[kernels[k]];
+            const UINT64 per_second = UINT64(stream.size() * 1e9 / best);
+            if (opts.format != STATS_WRITER::FORMAT_TEXT){
+                const uint64_t values[] = {
+                    set_counts[i], associativities[j], stream.size(), misses, expected,
+                    best, per_second, best * 1000 / stream.size()
+                };
+                writer.Record(label, values);
+            }
+            else {
+                out << ljstr(label, 25) << decstr(set_counts[i], 6) << decstr(associativities[j], 6)
+                    << decstr(misses, 12) << decstr(expected, 12) << decstr(per_second, 13)
+                    << fltstr(double(best) / stream.size(), 2, 12)
+                    << (failed ? "  MISMATCH" : "") << "\n";
+            }
+            if (failed)
+                cerr << label << " with " << set_counts[i] << " sets of " << associativities[j]
+                     << " ways: " << misses << " misses, expected " << expected << endl;
+        }
+    }
+
+    cerr << "checked " << checked << " miss counts, " << failures << " differ" << endl;
+
+    if (opts.check){
+        UINT32 spans = 0;
+        const UINT32 span_failures = CheckMissedLines(spans);
+        cerr << "checked " << spans << " missed line counts, " << span_failures << " differ" << endl;
+        failures += span_failures;
+
+        UINT32 prefetch_checks = 0;
+        const UINT32 prefetch_failures = CheckPrefetchLatency(prefetch_checks);
+        cerr << "checked " << prefetch_checks << " prefetch latency counts, " << prefetch_failures << " differ" << endl;
+        failures += prefetch_failures;
+    }
+    return failures ? 1 : 0;
+}
@@ -42,8 +42,9 @@ END_LEGAL */
 
 #include <stack>
 
-#include "cache.H"
+#include "icache_sim.H"
 #include "pin_profile.H"
+#include "spsc_ring.H"
 
 
 /* ===================================================================== */
@@ -54,41 +55,9 @@ using std::cerr;
 using std::string;
 using std::endl;
 using namespace std;
-#define _THREADID 15
-#define DEGREE_OF_USE 1.5
-#define MEDIUM_DEGREE_OF_USE 1.0
-#define INSTRUCTION_THRESHOLD 500000000
-#define MISS_PER_FUNCTION_THRESHOLD 15.0
-//#define ACTIVE_LOW_FUNCTION_LOGGING 0
-//#define PERLBENCH_DEBUG 0
 
 /* ===================================================================== */
 
-uint64_t total_misses = 0;
-uint64_t count_misses_from_low_degree_functions = 0;
-uint64_t count_misses_from_high_degree_functions = 0;
-
-uint64_t count_missses_from_low_degree_functions_after_call = 0;
-
-uint64_t count_misses_from_medium_degree_functions = 0;
-
-uint64_t count_misses_from_low_degree_functions_normal_cache = 0;
-
-uint64_t count_missses_from_low_degree_functions_normal_cache_after_call = 0;
-
-uint64_t count_misses_from_high_degree_functions_normal_cache = 0;
-uint64_t count_misses_from_medium_degree_functions_normal_cache = 0;
-
-uint64_t count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions = 0;
-uint64_t count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade = 0;
-uint64_t count_of_blocks_displaced_from_high_use_functions_by_low_use_two_functions = 0;
-uint64_t count_of_blocks_displaced_from_high_use_functions_by_high_use_functions = 0;
-uint64_t count_of_low_use_displacing_low_use_functions = 0;
-uint64_t count_of_low_use_allocated_way0 = 0;
-uint64_t total_misses_on_low_use_functions = 0;
-set<uint64_t> functions_with_low_use;
-set<uint64_t> total_functions;
-
 bool done = false;
 bool enable_instrumentation = true;
 
@@ -114,10 +83,113 @@ KNOB<UINT32> KnobITLBLineSize(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<UINT32> KnobITLBAssociativity(KNOB_MODE_WRITEONCE, "pintool",
                 "ai","8", "cache associativity (1 for direct mapped)");
 
+KNOB<UINT32> KnobL2Size(KNOB_MODE_WRITEONCE, "pintool",
+    "c2","0", "L2 size in kilobytes, 0 for no L2");
+KNOB<UINT32> KnobL2LineSize(KNOB_MODE_WRITEONCE, "pintool",
+    "b2","64", "L2 block size in bytes");
+KNOB<UINT32> KnobL2Associativity(KNOB_MODE_WRITEONCE, "pintool",
+    "a2","8", "L2 associativity (1 for direct mapped)");
+KNOB<UINT32> KnobLLCSize(KNOB_MODE_WRITEONCE, "pintool",
+    "c3","0", "LLC size in kilobytes, 0 for no LLC");
+KNOB<UINT32> KnobLLCLineSize(KNOB_MODE_WRITEONCE, "pintool",
+    "b3","64", "LLC block size in bytes");
+KNOB<UINT32> KnobLLCAssociativity(KNOB_MODE_WRITEONCE, "pintool",
+    "a3","16", "LLC associativity (1 for direct mapped)");
+KNOB<string> KnobInclusion(KNOB_MODE_WRITEONCE, "pintool",
+    "inclusion", "noninclusive", "fill policy of L2 and LLC: noninclusive, inclusive or exclusive");
+
+KNOB<string> KnobPageSize(KNOB_MODE_WRITEONCE, "pintool",
+    "page", "4k", "page size of the code for the TLB model: 4k, 2m or 1g");
+KNOB<UINT32> KnobTLBEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "tlb_i", "128", "first level ITLB entries, 0 for no TLB model");
+KNOB<UINT32> KnobTLBAssociativity(KNOB_MODE_WRITEONCE, "pintool",
+    "tlb_ia", "8", "first level ITLB associativity");
+KNOB<UINT32> KnobSTLBEntries(KNOB_MODE_WRITEONCE, "pintool",
+    "tlb_s", "1536", "second level TLB entries");
+KNOB<UINT32> KnobSTLBAssociativity(KNOB_MODE_WRITEONCE, "pintool",
+    "tlb_sa", "12", "second level TLB associativity");
+KNOB<UINT32> KnobSTLBLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "tlb_s_lat", "9", "cycles of a second level TLB lookup");
+KNOB<UINT32> KnobWalkLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "walk_lat", "8", "cycles per page table level of a page walk");
+
+KNOB<BOOL> KnobTiming(KNOB_MODE_WRITEONCE, "pintool",
+    "timing", "0", "estimate front-end stall cycles from the fetch outcomes");
+KNOB<UINT32> KnobL2Latency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat_l2", "14", "cycles of an IL1 miss served by the L2");
+KNOB<UINT32> KnobLLCLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat_llc", "40", "cycles of an IL1 miss served by the LLC");
+KNOB<UINT32> KnobMemoryLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "lat_mem", "200", "cycles of an IL1 miss served by memory");
+KNOB<BOOL> KnobOverlapBBL(KNOB_MODE_WRITEONCE, "pintool",
+    "overlap_bbl", "0", "overlap the miss stalls of a basic block, charging only the longest");
+
+KNOB<string> KnobPrefetcher(KNOB_MODE_WRITEONCE, "pintool",
+    "prefetch", "none", "instruction prefetcher: none, next, fdip or callret");
+KNOB<UINT32> KnobPrefetchDegree(KNOB_MODE_WRITEONCE, "pintool",
+    "pf_degree", "2", "lines (next, callret) or blocks (fdip) prefetched per trigger");
+KNOB<UINT32> KnobPrefetchLatency(KNOB_MODE_WRITEONCE, "pintool",
+    "pf_latency", "20", "instructions until a prefetch arrives, earlier uses are late");
+
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_period", "0", "instructions per sampling period, 0 simulates everything in detail");
+KNOB<UINT64> KnobSampleWarming(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_warming", "2000000", "instructions of functional warming before each detailed interval");
+KNOB<UINT64> KnobSampleDetailed(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_detailed", "1000000", "instructions simulated in detail at the end of each period");
+
+KNOB<string> KnobFootprint(KNOB_MODE_WRITEONCE, "pintool",
+    "footprint", "exact", "per-function footprint counting: exact or approx (fixed-size sketch)");
+KNOB<string> KnobFunctions(KNOB_MODE_WRITEONCE, "pintool",
+    "functions", "calls", "attribute fetches to functions by following calls and returns (calls) or by symbol (symbols)");
+KNOB<UINT32> KnobCallStackDepth(KNOB_MODE_WRITEONCE, "pintool",
+    "call_stack_depth", "1024", "frames of the shadow call stack used to follow calls and returns");
+KNOB<UINT32> KnobProfile(KNOB_MODE_WRITEONCE, "pintool",
+    "profile", "0", "time the simulation stages on one fetch in this many and report them with memory high-water marks, 0 for none");
+KNOB<BOOL> KnobBasicBlocks(KNOB_MODE_WRITEONCE, "pintool",
+    "bbl", "0", "instrument basic blocks instead of single instructions");
+KNOB<string> KnobThreads(KNOB_MODE_WRITEONCE, "pintool",
+    "threads", "all", "comma separated list of thread ids to simulate, or all");
+KNOB<string> KnobThreadOrder(KNOB_MODE_WRITEONCE, "pintool",
+    "thread_order", "", "comma separated creation order of threads to simulate, 0 is the main thread");
+KNOB<string> KnobThreadRoutine(KNOB_MODE_WRITEONCE, "pintool",
+    "thread_rtn", "", "simulate each thread from its first entry of this routine on");
+KNOB<UINT32> KnobPipeline(KNOB_MODE_WRITEONCE, "pintool",
+    "pipeline", "0", "simulate on this many internal worker threads fed through per-thread rings, 0 simulates on the application threads");
+KNOB<UINT32> KnobPipelineRing(KNOB_MODE_WRITEONCE, "pintool",
+    "pipeline_ring", "65536", "fetch records buffered per application thread with -pipeline");
+KNOB<string> KnobFetchTrace(KNOB_MODE_WRITEONCE, "pintool",
+    "trace", "", "record the fetch stream of all threads to this file for icache_replay");
+KNOB<string> KnobFetchTraceFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "trace_format", "chunked", "format of the -trace file: chunked (compressed, indexed) or raw");
+KNOB<string> KnobFormat(KNOB_MODE_WRITEONCE, "pintool",
+    "format", "text", "report format: text, jsonl, csv or binary");
+KNOB<UINT64> KnobInterval(KNOB_MODE_WRITEONCE, "pintool",
+    "interval", "0", "write counter deltas of each thread every N instructions, 0 for none");
+KNOB<string> KnobIntervalFile(KNOB_MODE_WRITEONCE, "pintool",
+    "interval_o", "", "interval output file name (default <o>.intervals)");
+
+KNOB<UINT64> KnobRoiStart(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_start", "0", "instructions of a thread before the region of interest opens");
+KNOB<UINT64> KnobRoiLength(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_length", "0", "instructions of a thread in the region of interest, 0 until exit");
+KNOB<string> KnobRoiStartRoutine(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_start_rtn", "", "open the region of interest at the first entry of this routine");
+KNOB<string> KnobRoiStopRoutine(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_stop_rtn", "", "close the region of interest at the first entry of this routine");
+KNOB<string> KnobRoiMarker(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_marker", "", "routine the application calls with one int, nonzero opens and 0 closes the region");
+KNOB<string> KnobRoiEnd(KNOB_MODE_WRITEONCE, "pintool",
+    "roi_end", "flush", "after the region of interest: flush (remove instrumentation), detach or keep");
+
+KNOB<string> KnobSweepSizes(KNOB_MODE_WRITEONCE, "pintool",
+    "sweep_c", "", "comma separated IL1 sizes in kilobytes for a single-pass LRU sweep");
+KNOB<string> KnobSweepAssociativities(KNOB_MODE_WRITEONCE, "pintool",
+    "sweep_a", "1,2,4,8,16", "comma separated associativities for the LRU sweep");
+KNOB<string> KnobSweepLineSizes(KNOB_MODE_WRITEONCE, "pintool",
+    "sweep_b", "64", "comma separated block sizes in bytes for the LRU sweep");
 
 
-#define MISS_THRESHOLD 50
-#define INVOCATION_THRESHOLD 50
 INT32 Usage()
 {
     cerr <<
@@ -131,132 +203,160 @@ INT32 Usage()
     return -1;
 }
 
-bool call_instr_seen = false;
-bool dir_jump_instr_seen = false;
-int64_t prev_dir_jump_page;
-bool syscall_seen = false;
-bool ind_call_instr_seen = false;
-bool return_instr_seen = false;
-bool ind_jump_seen = false;
-int64_t prev_ind_jump_page;
-uint64_t prev_ind_jump_iaddr;
 /* ===================================================================== */
 /* Global Variables */
 /* ===================================================================== */
 
-// wrap configuation constants into their own name space to avoid name clashes
-namespace IL1
-{
-    const UINT32 max_sets = KILO; // cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = 256; // associativity;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
-    
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE;
-}
+icache_config sim_config;
+STATS_WRITER::FORMAT report_format;
 
 
-// wrap configuation constants into their own name space to avoid name clashes
-namespace ITLB
+typedef enum
 {
-    const UINT32 max_sets = KILO*8; // cacheSize / (lineSize * associativity);
-    const UINT32 max_associativity = 256; // associativity;
-    const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
+    COUNTER_MISS = 0,
+    COUNTER_HIT = 1,
+    COUNTER_NUM
+} COUNTER;
 
-    typedef CACHE_MODIFIED_CACHE(max_sets, max_associativity, allocation) CACHE;
-}
 
-struct page_and_cache_block {
-    uint64_t x, y;
-    page_and_cache_block() {}
-    page_and_cache_block (int _x, int _y) {
-        x = _x;
-        y = _y;
-    }
-    bool operator<(const page_and_cache_block &rhs) const{
-        return make_pair(y,x) < make_pair(rhs.y, rhs.x);
-    }
-    bool operator==(const page_and_cache_block &rhs) const{
-        return make_pair(y,x) == make_pair(rhs.y, rhs.x);
-    }
-};
+typedef  COUNTER_ARRAY<UINT64, COUNTER_NUM> COUNTER_HIT_MISS;
 
-struct function_stats{
-	set<uint64_t> unique_cache_blocks_touched_by_function;
-	uint64_t func_miss_count;
-	uint64_t func_total_itlb_miss_count;
-	uint64_t func_total_miss_count;
-	uint64_t func_invocation_count;
-	//function classified as low use function. 
-	bool low_degree_function;
-	bool medium_degree_function;
-	bool initialized;
-};
 
-//maintain this per callee address or per cache block. 
-map<uint64_t, function_stats> function_invocation_count;
+// holds the counters with misses and hits
+// conceptually this is an array indexed by instruction address
+COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile;
+
+#define TRACE_BUFFER_RECORDS 16384
 
+//records are collected per thread and handed to the trace writer in
+//whole buffers, so the lock is taken once per TRACE_BUFFER_RECORDS fetches.
+struct trace_buffer{
+	UINT32 count;
+	fetch_record records[TRACE_BUFFER_RECORDS];
+};
 
-ITLB::CACHE* itlb = NULL;
+struct function_symbol;
+
+//one instruction passed from an application thread to a pipeline worker
+struct queued_fetch{
+	ADDRINT addr;
+	const function_symbol* function;
+	UINT8 size;
+	UINT8 kind;
+	//false for predicated instructions that did not execute, which are
+	//counted but not fetched
+	UINT8 executing;
+};
 
+typedef SPSC_RING<queued_fetch> FETCH_RING;
+
+//everything an analysis routine touches lives here, one instance per thread
+//in Pin TLS, so threads are simulated without locks or shared counters.
+struct thread_data{
+	THREADID tid;
+	//NULL for threads that are not simulated
+	ICACHE_SIM* sim;
+	// The running count of instructions is kept here
+	UINT64 icount;
+	bool reported;
+	//NULL unless the fetch stream is recorded
+	trace_buffer* trace;
+	//icount at which the next interval line is written, never reached
+	//when intervals are off
+	UINT64 next_interval;
+	//sampling phase of the thread, always detailed without sampling
+	SAMPLE_SCHEDULE schedule;
+	//instructions before the region of interest opened
+	UINT64 skipped;
+	//with -pipeline, NULL for threads that are never simulated: the fetches
+	//the worker simulates, and the instructions queued so far. icount and
+	//everything the simulation uses then belong to the worker.
+	FETCH_RING* ring;
+	UINT64 queued;
+};
 
-IL1::CACHE* il1 = NULL;
+TLS_KEY thread_key;
 
-//datastructures used to note the number of cache blocks
-//that are constitute a function. 
-stack <uint64_t> call_stack;
-map<page_and_cache_block, set<uint64_t>> mapping_from_function_to_number_of_cache_blocks;
-//current function identified by the cache block
-//that the callee address is a part of
-page_and_cache_block current_function(0,0);
-uint64_t current_function_callee_address = 1;
-uint64_t current_cache_block;
-set<uint64_t> number_of_active_low_use_functions;
-vector<uint64_t> list_of_active_low_use_function_counts;
+//all threads seen so far, only used at thread start and for the final report
+vector<thread_data*> all_threads;
+PIN_LOCK all_threads_lock;
 
-//number of cache blocks part of a function in perlbench. 
-set<uint64_t> number_of_cache_blocks_part_of_function_of_interest_perlbench;
-uint64_t instructions_spent_in_function_of_interest = 0;
-bool recorded = false;
+//thread selection, a thread is simulated when it matches any given criterion
+std::vector<UINT32> simulated_threads;
+std::vector<UINT32> simulated_thread_order;
+//number of threads started so far, the creation order of the next one
+UINT32 thread_starts;
 
+//nonzero for threads whose analysis calls do anything: simulated threads,
+//or all threads while the fetch stream is recorded. Indexed by THREADID so
+//that the If calls guarding every analysis call can be inlined.
+UINT8 thread_active[PIN_MAX_THREADS];
 
+//the window opens and closes once for the whole process. Outside of it only
+//the triggers of TriggerTrace are instrumented, and every change of the state removes
+//all instrumentation so that the code is instrumented again for the new state.
 typedef enum
 {
-    COUNTER_MISS = 0,
-    COUNTER_HIT = 1,
-    COUNTER_NUM
-} COUNTER;
+    ROI_WAITING,
+    ROI_OPEN,
+    ROI_CLOSED
+} ROI_STATE;
 
+typedef enum
+{
+    ROI_END_FLUSH,
+    ROI_END_DETACH,
+    ROI_END_KEEP
+} ROI_END;
+
+volatile ROI_STATE roi_state;
+ROI_END roi_end;
+PIN_LOCK roi_lock;
+//icount of a thread at which the window closes, never reached without a length
+UINT64 roi_stop_icount;
+
+//entry addresses of the trigger routines in all loaded images
+std::set<ADDRINT> roi_start_entries;
+std::set<ADDRINT> roi_stop_entries;
+std::set<ADDRINT> roi_marker_entries;
+std::set<ADDRINT> thread_routine_entries;
+
+//the function an instruction belongs to, resolved from the symbols when it
+//is instrumented with -functions symbols. Ids are given in the order the
+//functions are first instrumented, and all code without a symbol shares
+//the one function at entry 1
+struct function_symbol{
+	UINT32 id;
+	ADDRINT entry;
+};
 
-//counters to count the number of itlb misses happening after different kinds of 
-//global control transfer instructions.
-
-uint64_t itlb_misses_after_call = 0;
-uint64_t icache_misses_after_ind_jump = 0;
-uint64_t itlb_misses_after_return = 0;
-uint64_t itlb_misses_after_syscall = 0;
-uint64_t itlb_misses_after_none_of_above = 0;
-
-uint64_t icache_misses_after_long_jump = 0;
-
-//cache misses from shared library
-uint64_t icache_misses_from_shared_library = 0;
-
-typedef  COUNTER_ARRAY<UINT64, COUNTER_NUM> COUNTER_HIT_MISS;
-
-set<uint64_t> list_of_high_use_blocks_replaced;
-
+//symbols by entry address, only used at instrumentation time
+std::map<ADDRINT, function_symbol*> function_symbols;
+FUNCTION_NAMES function_names;
 
+static inline thread_data* GetThreadData(THREADID tid)
+{
+    return static_cast<thread_data*>(PIN_GetThreadData(thread_key, tid));
+}
 
-// holds the counters with misses and hits
-// conceptually this is an array indexed by instruction address
-COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile;
+// If call of every analysis routine, kept free of calls and branches so
+// that Pin inlines it; the Then call only runs for active threads in the
+// region of interest
+ADDRINT PIN_FAST_ANALYSIS_CALL IsActive(THREADID tid)
+{
+    return thread_active[tid] & (roi_state == ROI_OPEN);
+}
 
 /* ===================================================================== */
 
-VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId)
+VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId, THREADID tid)
 {
+    ICACHE_SIM* sim = GetThreadData(tid)->sim;
+    if (sim == NULL)
+        return;
+
     // first level I-cache
-    const BOOL il1Hit = il1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    const BOOL il1Hit = sim->il1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     const COUNTER counter = il1Hit ? COUNTER_HIT : COUNTER_MISS;
     profile[instId][counter]++;
@@ -264,623 +364,738 @@ VOID LoadMulti(ADDRINT addr, UINT32 size, UINT32 instId)
 
 /* ===================================================================== */
 
-VOID LoadSingle(ADDRINT addr, UINT32 instId)
+VOID LoadSingle(ADDRINT addr, UINT32 instId, THREADID tid)
 {
+    ICACHE_SIM* sim = GetThreadData(tid)->sim;
+    if (sim == NULL)
+        return;
+
     // @todo we may access several cache lines for 
     // first level I-cache
-    const BOOL il1Hit = il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
+    const BOOL il1Hit = sim->il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);
 
     const COUNTER counter = il1Hit ? COUNTER_HIT : COUNTER_MISS;
     profile[instId][counter]++;
 }
 
+/* ===================================================================== */
+/* Fetch trace recording */
 /* ===================================================================== */
 
-VOID LoadMultiFast(ADDRINT addr, UINT32 size, THREADID tid)
+//full buffers waiting beyond which an application thread waits for the writer
+#define TRACE_QUEUE_BUFFERS 64
+
+FETCH_TRACE_WRITER trace_writer;
+//guards the queues, and the writer once the writer thread has ended
+PIN_LOCK trace_lock;
+
+//an internal thread compresses and writes the full buffers, the application
+//threads only queue them and take an empty one
+std::vector<trace_buffer*> trace_queue;
+std::vector<trace_buffer*> trace_free;
+PIN_THREAD_UID trace_writer_uid = INVALID_PIN_THREAD_UID;
+volatile bool trace_writer_stop;
+//set once the writer thread has ended, or when it never started, buffers
+//are then written by the thread that fills them
+volatile bool trace_writer_done = true;
+
+// hands the buffer of a thread to the writer and gives the thread an empty one
+VOID FlushTraceBuffer(thread_data* data)
 {
-
-   if (tid == _THREADID){ 
-       //first step is to identify the function we are executing, sometimes we might jump out to function 
-       //to run another function and then get back to executing a function. This necessitates the use of call stack
-       //to identify the function we are executing.  
-       //uint64_t cache_block_addr;
-       //cache_block_addr = addr/64;
-       //if we access a new cache block, then we record this cache block as part of the current function. 
-       //work with the assumption a function call involves access of a new cache block.
-       //if (cache_block_addr != current_cache_block){
-       	  if (call_instr_seen){
-	    call_stack.push(current_function_callee_address);
-	    current_function_callee_address = addr;
-#ifdef ACTIVE_LOW_FUNCTION_LOGGING 
-	    //whenever a low use function becomes active, make a note
-	    if (function_invocation_count[current_function_callee_address].low_degree_function)
-		number_of_active_low_use_functions.insert(current_function_callee_address);
-#endif 
-	  }
-	  else if(return_instr_seen){
-	    if (call_stack.size()!=0){
-		current_function_callee_address = call_stack.top();
-		call_stack.pop();
-	    }
-	  }
-	 function_invocation_count[current_function_callee_address].unique_cache_blocks_touched_by_function.insert(addr/64); 
-	 uint64_t number_of_function_misses = 0;
-	 uint64_t number_of_function_invocations = 0; 
-         if (function_invocation_count.find(current_function_callee_address) == 
-          		function_invocation_count.end()){
-         	number_of_function_misses = 0;
-        	function_invocation_count[current_function_callee_address].func_miss_count = 0;
-                function_invocation_count[current_function_callee_address].func_total_miss_count = 0;
-		function_invocation_count[current_function_callee_address].func_invocation_count = 0;
-		function_invocation_count[current_function_callee_address].low_degree_function = false;
-		function_invocation_count[current_function_callee_address].medium_degree_function = false;
-		function_invocation_count[current_function_callee_address].initialized = true;
-	 }
-	 else{
-	 	number_of_function_misses = function_invocation_count[current_function_callee_address].func_miss_count;
-	        number_of_function_invocations = function_invocation_count[current_function_callee_address].func_invocation_count;	
-	 }
-	 float degree_of_use;
-	 if (number_of_function_misses == 0)
-		 number_of_function_misses = 1;
-	 degree_of_use = (float)number_of_function_invocations/number_of_function_misses;
-	 hit_and_use_information temp,temp1;
-       
-     	 //set the degree of use flag to true for code
-       //from functions with a high degree of use. 
-       //because degree of use affects placement in the cache, allow for a few misses before we start to place functions
-       //assuming they are a low use function.  
-       
-	 bool degree_of_use_bool;
-	 if (degree_of_use<= DEGREE_OF_USE){
-		degree_of_use_bool = false;
-		//classify the function once and for all as low use, because otherwise
-		//function's class might change to high use and again start to interfere 
-		//with high use functions, which we want to avoid. 
-	// 	float misses_per_function = ((float)function_invocation_count[current_function_callee_address].func_total_miss_count/
-	//						function_invocation_count[current_function_callee_address].func_miss_count);
-		if ((number_of_function_misses>= MISS_THRESHOLD) && 
-			       // (misses_per_function<= MISS_PER_FUNCTION_THRESHOLD) &&	
-				(!function_invocation_count[current_function_callee_address].low_degree_function)){
-		   //check if the function has the medim degree of use, and if yes, set the additional medium degree of use
-		   //flag.
-		   if (degree_of_use > MEDIUM_DEGREE_OF_USE)
-		       function_invocation_count[current_function_callee_address].medium_degree_function = true;	   
-		   function_invocation_count[current_function_callee_address].low_degree_function = true;
-		}	       
-	 }
-	 //if a function goes from being a low use function to 
-	 //seeing more use, then check and revert the low degree function flag.
-	 else{
-		 degree_of_use_bool = true;
-	// 	if (function_invocation_count[current_function_callee_address].low_degree_function)
-	//		function_invocation_count[current_function_callee_address].low_degree_function = false;
-	 }
-	 if ((degree_of_use_bool)||(number_of_function_misses<= MISS_THRESHOLD))
-	 	temp = il1->Access_selective_allocate(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, true, true, false, false);
-	 else
-       		temp = il1->Access_selective_allocate(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, true, false, false, false);
-	 if (function_invocation_count[current_function_callee_address].low_degree_function){
-		 bool medium_degree_of_use = false;
-		 //if (function_invocation_count[current_function_callee_address].medium_degree_function)
-			 medium_degree_of_use = true;
-		 temp1 = itlb->Access_selective_allocate(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD, true, false, medium_degree_of_use, false);
-	 }
-	 else
-       		temp1 = itlb->Access_selective_allocate(addr, size,  CACHE_BASE::ACCESS_TYPE_LOAD, true, true, false, false);
-       
-	 if (!temp.icache_hit)
-		total_misses++;
-	 if (!temp1.icache_hit){
-	 total_misses_on_low_use_functions = temp1.total_low_use_misses;
-	 }
-	 //count number of misses coming from function invoked a lot and which are not low use. 
-	 if (((!function_invocation_count[current_function_callee_address].low_degree_function)&&
-				 (function_invocation_count[current_function_callee_address].func_invocation_count>=INVOCATION_THRESHOLD)
-				 &&(!temp1.icache_hit))){
-	    count_misses_from_high_degree_functions++; 
-	    //if replaced block was from a high use function, then this flag would be set.
-            
-    	    const ADDRINT notLineMask = ~(64 - 1);
-	    uint64_t current_cache_block_address = addr&notLineMask;
-	    if (temp1.function_use_information){
-	      count_of_blocks_displaced_from_high_use_functions_by_high_use_functions++;	 
-	      //if current block was replaced by a low use function or in a cascade of misses
-	      //following the miss from a low use function. 
-	      if (list_of_high_use_blocks_replaced.find(current_cache_block_address) !=
-			      list_of_high_use_blocks_replaced.end()){
-		  //add all the high use code we replace to the list of blocks replaced part of 
-		  //the cascade. 
-	      	  count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade += 
-		     temp1.blk_addresses.size(); 
-		  for (uint64_t i = 0;i<temp1.blk_addresses.size();i++) 
-			 list_of_high_use_blocks_replaced.insert(temp1.blk_addresses.at(i));
-	      
-	      }
-	    }
-	 }
-	 else if (((function_invocation_count[current_function_callee_address].low_degree_function)&&
-				 (!temp1.icache_hit))){
-	    count_misses_from_low_degree_functions++; 
-	    if (call_instr_seen)
-		count_missses_from_low_degree_functions_after_call++;
-	    //if replaced block was from a high use function, then this flag would be set.
-	    if (temp1.function_use_information){
-		count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions++;		
-	        count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade += 
-			temp1.blk_addresses.size();
-		for (uint64_t i = 0;i<temp1.blk_addresses.size();i++) 
-			list_of_high_use_blocks_replaced.insert(temp1.blk_addresses.at(i));
-	    }
-	    else
-		count_of_low_use_displacing_low_use_functions++;
-	    if (temp1.allocated_way == 0)
-		count_of_low_use_allocated_way0+= 1;
-	    functions_with_low_use.insert(current_function_callee_address); 
-	 }
-	 if (((!function_invocation_count[current_function_callee_address].low_degree_function) &&(function_invocation_count[current_function_callee_address].func_invocation_count>=INVOCATION_THRESHOLD)
-		&&(!temp.icache_hit)))
-	     count_misses_from_high_degree_functions_normal_cache++;
-	 else if (((function_invocation_count[current_function_callee_address].low_degree_function)&&(!temp.icache_hit))){
-	     count_misses_from_low_degree_functions_normal_cache++;
-	     if (call_instr_seen)
-		     count_missses_from_low_degree_functions_normal_cache_after_call++;
-	 }
-	 if (!temp1.icache_hit){
-    	     const ADDRINT notLineMask = ~(64 - 1);
-	     uint64_t current_cache_block_address = addr&notLineMask;
-	     //remove current block from the list of high use blocks, because we have already counted
-	     //its removal once and have also accounted for any cascade if any above. 
-	     list_of_high_use_blocks_replaced.erase(current_cache_block_address);	
-	 }
-////	  
-//////       }	
-        if (!temp1.icache_hit){
-           if (call_instr_seen){
-        		if ((function_invocation_count.find(current_function_callee_address) != function_invocation_count.end())){
-		   		function_invocation_count[current_function_callee_address].func_miss_count++;
-        			function_invocation_count[current_function_callee_address].func_total_miss_count++;
-				function_invocation_count[current_function_callee_address].func_invocation_count++;
-			}
-           }
-	   else
-	    function_invocation_count[current_function_callee_address].func_total_miss_count++;
-	}
-        else{
-	  if (call_instr_seen)     
-           function_invocation_count[current_function_callee_address].func_invocation_count++;
+    trace_buffer* buffer = data->trace;
+    if (buffer->count == 0)
+        return;
+
+    PIN_GetLock(&trace_lock, data->tid+1);
+    //back-pressure: a thread that gets ahead of the writer waits for it
+    while (trace_queue.size() >= TRACE_QUEUE_BUFFERS && !trace_writer_done){
+        PIN_ReleaseLock(&trace_lock);
+        PIN_Yield();
+        PIN_GetLock(&trace_lock, data->tid+1);
+    }
+    if (trace_writer_done){
+        trace_writer.Write(buffer->records, buffer->count);
+        buffer->count = 0;
+    }
+    else {
+        trace_queue.push_back(buffer);
+        if (trace_free.empty())
+            data->trace = new trace_buffer;
+        else {
+            data->trace = trace_free.back();
+            trace_free.pop_back();
         }
-//       if (!temp1.icache_hit){
-//          if (call_instr_seen)     
-//		function_invocation_count[current_function_callee_address].func_total_itlb_miss_count++;	
-//       }
-       call_instr_seen = false;
-       ind_jump_seen = false;
-       return_instr_seen = false;
-       syscall_seen = false;
-       dir_jump_instr_seen = false;
-   }	
-//	il1->Access(addr, size, CACHE_BASE::ACCESS_TYPE_LOAD);
+        data->trace->count = 0;
+    }
+    PIN_ReleaseLock(&trace_lock);
 }
 
-/* ===================================================================== */
+static inline VOID AppendFetch(thread_data* data, ADDRINT iaddr, UINT32 size, UINT32 kind,
+                               BOOL executing, THREADID tid)
+{
+    trace_buffer* buffer = data->trace;
+    fetch_record &record = buffer->records[buffer->count++];
+    record.addr = iaddr;
+    record.tid = tid;
+    record.size = size;
+    record.kind = kind;
+    record.flags = executing ? FETCH_FLAG_EXECUTED : 0;
+    record.reserved = 0;
+    if (buffer->count == TRACE_BUFFER_RECORDS)
+        FlushTraceBuffer(data);
+}
+
+VOID RecordFetch(ADDRINT iaddr, UINT32 size, UINT32 kind, BOOL executing, THREADID tid)
+{
+    AppendFetch(GetThreadData(tid), iaddr, size, kind, executing, tid);
+}
 
-VOID LoadSingleFast(ADDRINT addr, THREADID tid)
+VOID TraceWriter(VOID* arg)
 {
-   if (tid == _THREADID){ 
-       //first step is to identify the function we are executing, sometimes we might jump out to function 
-       //to run another function and then get back to executing a function. This necessitates the use of call stack
-       //to identify the function we are executing.  
-       //uint64_t cache_block_addr;
-       //cache_block_addr = addr/64;
-       //if we access a new cache block, then we record this cache block as part of the current function. 
-       //work with the assumption a function call involves access of a new cache block.
-       //if (cache_block_addr != current_cache_block){
-       	  if (call_instr_seen){
-            call_stack.push(current_function_callee_address);
-            current_function_callee_address = addr;
-          }
-          else if(return_instr_seen){
-            if (call_stack.size()!=0){
-        	current_function_callee_address = call_stack.top();
-        	call_stack.pop();
-            }
-          }
-         
-	 function_invocation_count[current_function_callee_address].unique_cache_blocks_touched_by_function.insert(addr/64); 
-         uint64_t number_of_function_misses = 0;
-         uint64_t number_of_function_invocations = 0; 
-         if (function_invocation_count.find(current_function_callee_address) == 
-          		function_invocation_count.end()){
-         	number_of_function_misses = 0;
-        	function_invocation_count[current_function_callee_address].func_miss_count = 0;
-                function_invocation_count[current_function_callee_address].func_total_miss_count = 0;
-		function_invocation_count[current_function_callee_address].func_invocation_count = 0;
-		function_invocation_count[current_function_callee_address].low_degree_function = false;
-		function_invocation_count[current_function_callee_address].medium_degree_function = false;
-		function_invocation_count[current_function_callee_address].initialized = true;
-         }
-         else{
-         	number_of_function_misses = function_invocation_count[current_function_callee_address].func_miss_count;
-                number_of_function_invocations = function_invocation_count[current_function_callee_address].func_invocation_count;	
-         }
-         float degree_of_use;
-         if (number_of_function_misses == 0)
-        	 number_of_function_misses = 1;
-         degree_of_use = (float)number_of_function_invocations/number_of_function_misses;
-         hit_and_use_information temp,temp1;
-         
-       	 //set the degree of use flag to true for code
-         //from functions with a high degree of use. 
-         //because degree of use affects placement in the cache, allow for a few misses before we start to place functions
-         //assuming they are a low use function.  
-         
-         bool degree_of_use_bool;
-         if (degree_of_use<= DEGREE_OF_USE){
-        	degree_of_use_bool = false;
-        	//classify the function once and for all as low use, because otherwise
-        	//function's class might change to high use and again start to interfere 
-        	//with high use functions, which we want to avoid. 
-        // 	float misses_per_function = ((float)function_invocation_count[current_function_callee_address].func_total_miss_count/
-        //						function_invocation_count[current_function_callee_address].func_miss_count);
-        	if ((number_of_function_misses>= MISS_THRESHOLD) && 
-        		      //  (misses_per_function<= MISS_PER_FUNCTION_THRESHOLD) &&	
-        			(!function_invocation_count[current_function_callee_address].low_degree_function)){
-        	       
-		   //check if the function has the medim degree of use, and if yes, set the additional medium degree of use
-		   //flag.
-		   	if (degree_of_use > MEDIUM_DEGREE_OF_USE)
-		       		function_invocation_count[current_function_callee_address].medium_degree_function = true;	   
-		   	function_invocation_count[current_function_callee_address].low_degree_function = true;	
-		}
-         }
-	 //if a function goes from being a low use function to 
-	 //seeing more use, then check and revert the low degree function flag.
-	 else{
-		degree_of_use_bool = true;
-	// 	if (function_invocation_count[current_function_callee_address].low_degree_function)
-	//		function_invocation_count[current_function_callee_address].low_degree_function = false;
-	 }
-         if ((degree_of_use_bool)||(number_of_function_misses<= MISS_THRESHOLD))
-         	temp = il1->AccessSingleLine_selective_allocate(addr, CACHE_BASE::ACCESS_TYPE_LOAD, true, true, false, false);
-         else
-         	temp = il1->AccessSingleLine_selective_allocate(addr, CACHE_BASE::ACCESS_TYPE_LOAD, true, false, false, false);
-         if (function_invocation_count[current_function_callee_address].low_degree_function){
-		 bool medium_degree_of_use = false;
-		 //if (function_invocation_count[current_function_callee_address].medium_degree_function)
-			 medium_degree_of_use = true;
-         	 temp1 = itlb->AccessSingleLine_selective_allocate(addr, CACHE_BASE::ACCESS_TYPE_LOAD, true, false, medium_degree_of_use, false);
-	 }
-         else
-         	temp1 = itlb->AccessSingleLine_selective_allocate(addr,  CACHE_BASE::ACCESS_TYPE_LOAD, true, true, false, false);
-         
-         if (!temp.icache_hit)
-        	total_misses++;
-         if (!temp1.icache_hit){
-         total_misses_on_low_use_functions = temp1.total_low_use_misses;
-         }
-         //count number of misses coming from function invoked a lot and which are not low use. 
-         if (((!function_invocation_count[current_function_callee_address].low_degree_function)&&
-        			 (function_invocation_count[current_function_callee_address].func_invocation_count>=INVOCATION_THRESHOLD)
-        			 &&(!temp1.icache_hit))){
-            count_misses_from_high_degree_functions++; 
-            //if replaced block was from a high use function, then this flag would be set.
-            
-    	    const ADDRINT notLineMask = ~(64 - 1);
-            uint64_t current_cache_block_address = addr&notLineMask;
-            if (temp1.function_use_information){
-              count_of_blocks_displaced_from_high_use_functions_by_high_use_functions++;	 
-              //if current block was replaced by a low use function or in a cascade of misses
-              //following the miss from a low use function. 
-              if (list_of_high_use_blocks_replaced.find(current_cache_block_address) !=
-        		      list_of_high_use_blocks_replaced.end()){
-        	  //add all the high use code we replace to the list of blocks replaced part of 
-        	  //the cascade. 
-              	  count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade += 
-        	     temp1.blk_addresses.size(); 
-        	  for (uint64_t i = 0;i<temp1.blk_addresses.size();i++) 
-        		 list_of_high_use_blocks_replaced.insert(temp1.blk_addresses.at(i));
-              
-              }
-            }
-         }
-         else if (((function_invocation_count[current_function_callee_address].low_degree_function)&&
-        			 (!temp1.icache_hit))){
-            count_misses_from_low_degree_functions++; 
-	    if (call_instr_seen)
-		count_missses_from_low_degree_functions_after_call++;
-	    //if replaced block was from a high use function, then this flag would be set.
-            if (temp1.function_use_information){
-        	count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions++;		
-                count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade += 
-        		temp1.blk_addresses.size();
-        	for (uint64_t i = 0;i<temp1.blk_addresses.size();i++) 
-        		list_of_high_use_blocks_replaced.insert(temp1.blk_addresses.at(i));
-            }
-            else
-        	count_of_low_use_displacing_low_use_functions++;
-            if (temp1.allocated_way == 0)
-        	count_of_low_use_allocated_way0+= 1;
-            functions_with_low_use.insert(current_function_callee_address); 
-         }
-         if (((!function_invocation_count[current_function_callee_address].low_degree_function) &&(function_invocation_count[current_function_callee_address].func_invocation_count>=INVOCATION_THRESHOLD)
-        	&&(!temp.icache_hit)))
-             count_misses_from_high_degree_functions_normal_cache++;
-         else if (((function_invocation_count[current_function_callee_address].low_degree_function)&&(!temp.icache_hit))){
-             count_misses_from_low_degree_functions_normal_cache++;
-	     if (call_instr_seen)
-		     count_missses_from_low_degree_functions_normal_cache_after_call++;
-	 }
-         if (!temp1.icache_hit){
-    	     const ADDRINT notLineMask = ~(64 - 1);
-             uint64_t current_cache_block_address = addr&notLineMask;
-             //remove current block from the list of high use blocks, because we have already counted
-             //its removal once and have also accounted for any cascade if any above. 
-             list_of_high_use_blocks_replaced.erase(current_cache_block_address);	
-         }
-////	  
-//////       }	
-        if (!temp1.icache_hit){
-           if (call_instr_seen){
-
-        	if (function_invocation_count.find(current_function_callee_address) != function_invocation_count.end()){
-        		function_invocation_count[current_function_callee_address].func_miss_count++;
-        		function_invocation_count[current_function_callee_address].func_total_miss_count++;
-        		function_invocation_count[current_function_callee_address].func_invocation_count++;
-		}
-	   }
-           else
-            function_invocation_count[current_function_callee_address].func_total_miss_count++;
+    const THREADID tid = PIN_ThreadId();
+    std::vector<trace_buffer*> buffers;
+    for (;;)
+    {
+        const bool stopping = trace_writer_stop;
+
+        PIN_GetLock(&trace_lock, tid+1);
+        buffers.swap(trace_queue);
+        PIN_ReleaseLock(&trace_lock);
+
+        if (buffers.empty()){
+            if (stopping)
+                break;
+            PIN_Sleep(1);
+            continue;
         }
-       else{
-          if (call_instr_seen)     
-           function_invocation_count[current_function_callee_address].func_invocation_count++;
-       }
-       call_instr_seen = false;
-       ind_jump_seen = false;
-       return_instr_seen = false;
-       syscall_seen = false;
-       dir_jump_instr_seen = false;
-   }	
-	
-	
-  // il1->AccessSingleLine(addr, CACHE_BASE::ACCESS_TYPE_LOAD);    
+        for (UINT32 i = 0; i < buffers.size(); i++)
+            trace_writer.Write(buffers[i]->records, buffers[i]->count);
+
+        PIN_GetLock(&trace_lock, tid+1);
+        trace_free.insert(trace_free.end(), buffers.begin(), buffers.end());
+        PIN_ReleaseLock(&trace_lock);
+        buffers.clear();
+    }
 }
 
+bool StartTraceWriter()
+{
+    trace_writer_done = false;
+    return PIN_SpawnInternalThread(TraceWriter, NULL, 0, &trace_writer_uid) != INVALID_THREADID;
+}
 
-VOID Syscall_Instruction_Single(ADDRINT iaddr, THREADID tid)
+// writes the queued buffers and ends the writer thread, later buffers are
+// written by their threads
+VOID StopTraceWriter()
 {
-    if (tid == _THREADID){
-       LoadSingleFast(iaddr,tid);
-       syscall_seen = true;
-    }
+    if (trace_writer_uid == INVALID_PIN_THREAD_UID || trace_writer_done)
+        return;
+    trace_writer_stop = true;
+    PIN_WaitForThreadTermination(trace_writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+
+    //buffers queued after the last pass of the writer
+    PIN_GetLock(&trace_lock, PIN_ThreadId()+1);
+    for (UINT32 i = 0; i < trace_queue.size(); i++)
+        trace_writer.Write(trace_queue[i]->records, trace_queue[i]->count);
+    trace_free.insert(trace_free.end(), trace_queue.begin(), trace_queue.end());
+    trace_queue.clear();
+    trace_writer_done = true;
+    PIN_ReleaseLock(&trace_lock);
 }
 
-VOID Direct_Call_Instruction_Single(ADDRINT iaddr, THREADID tid)
+/* ===================================================================== */
+/* Reports */
+/* ===================================================================== */
+
+VOID WriteReport(ICACHE_SIM* sim, const string & name)
 {
-    if (tid == _THREADID){
-       LoadSingleFast(iaddr,tid);
-       call_instr_seen = true;
+    //the per-instruction profile of -ti is only part of the text report
+    if (report_format != STATS_WRITER::FORMAT_TEXT) {
+        STATS_WRITER writer;
+        if (!writer.Open(name.c_str(), report_format)) {
+            cerr << "Could not open report " << name << endl;
+            return;
+        }
+        sim->WriteStats(writer);
+        return;
     }
+
+    std::ofstream out(name.c_str());
+
+    // print I-cache profile
+    // @todo what does this print
+    sim->PrintCacheStats(out);
+
+    if (KnobTrackInsts) {
+        out <<
+            "#\n"
+            "# INST stats\n"
+            "#\n";
+        
+        out << profile.StringLong();
+    }
+    sim->PrintFunctionStats(out);
+    out.close();
 }
 
-VOID Direct_Jump_Instruction_Single(ADDRINT iaddr, THREADID tid)
+string ThreadReportName(THREADID tid)
 {
-    if (tid == _THREADID){
-    	LoadSingleFast(iaddr,tid);
-    	dir_jump_instr_seen = true;
-    	prev_dir_jump_page = (iaddr/4096);
-    }
+    return KnobOutputFile.Value() + "." + decstr(tid);
 }
 
-VOID Indirect_Call_Instruction_Single(ADDRINT iaddr, THREADID tid)
+//lines of all threads are appended to one stream, each tagged with its tid
+std::ofstream interval_out;
+PIN_LOCK interval_lock;
+
+VOID WriteInterval(thread_data* data, bool final)
 {
+    PIN_GetLock(&interval_lock, data->tid+1);
+    data->sim->WriteInterval(interval_out, data->tid, data->icount, final);
+    PIN_ReleaseLock(&interval_lock);
+}
 
-    if (tid == _THREADID){
-        LoadSingleFast(iaddr,tid);
-        call_instr_seen = true;
-        ind_call_instr_seen = true;
-    }
+/* ===================================================================== */
+
+bool IsSimulatedThread(THREADID tid, UINT32 order)
+{
+    if (simulated_threads.empty() && simulated_thread_order.empty() &&
+        KnobThreadRoutine.Value().empty())
+        return true;
+    for (UINT32 i = 0; i < simulated_threads.size(); i++)
+        if (simulated_threads[i] == tid)
+            return true;
+    for (UINT32 i = 0; i < simulated_thread_order.size(); i++)
+        if (simulated_thread_order[i] == order)
+            return true;
+    return false;
 }
 
+VOID StartSimulation(thread_data* data)
+{
+    data->sim = new ICACHE_SIM(sim_config);
+    if (data->schedule.Enabled() && data->schedule.Phase() == SAMPLE_PHASE_DETAILED)
+        data->sim->BeginSample();
+    thread_active[data->tid] = 1;
+}
 
-VOID Indirect_Jump_Instruction_Single(ADDRINT iaddr, THREADID tid)
+// entry of the -thread_rtn routine, the thread is simulated from here on
+VOID SelectThread(THREADID tid)
 {
+    thread_data* data = GetThreadData(tid);
+    if (data->sim == NULL)
+        StartSimulation(data);
+}
 
-    if (tid == _THREADID){
-        LoadSingleFast(iaddr,tid);
-        ind_jump_seen = true;
-        prev_ind_jump_page = iaddr/4096;
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    thread_data* data = new thread_data;
+    data->tid = tid;
+    data->sim = NULL;
+    data->icount = 0;
+    data->reported = false;
+    data->trace = NULL;
+    data->next_interval = KnobInterval.Value() ? KnobInterval.Value() : ~UINT64(0);
+    data->skipped = 0;
+    data->schedule = SAMPLE_SCHEDULE(sim_config.sampling);
+    data->ring = NULL;
+    data->queued = 0;
+    if (!KnobFetchTrace.Value().empty()) {
+        data->trace = new trace_buffer;
+        data->trace->count = 0;
     }
+    PIN_SetThreadData(thread_key, data, tid);
+
+    //the ring is in place before the workers can see the thread
+    PIN_GetLock(&all_threads_lock, tid+1);
+    const UINT32 order = thread_starts++;
+    const bool simulated = IsSimulatedThread(tid, order);
+    if (KnobPipeline.Value() && (simulated || !KnobThreadRoutine.Value().empty()))
+        data->ring = new FETCH_RING(KnobPipelineRing.Value());
+    all_threads.push_back(data);
+    PIN_ReleaseLock(&all_threads_lock);
+
+    thread_active[tid] = (data->trace != NULL);
+    if (simulated)
+        StartSimulation(data);
 }
 
-VOID Return_Instruction_Single(ADDRINT iaddr, THREADID tid)
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
-
-    if (tid == _THREADID){
-         LoadSingleFast(iaddr,tid);
-         //set that we have seen a return instruction
-         //cleared at the end of processing the next instruction.
-         return_instr_seen = true;
+    //the simulation state is kept until Fini for the merged report, the
+    //id may be given to a new thread
+    thread_data* data = GetThreadData(tid);
+    thread_active[tid] = 0;
+    if (data->trace != NULL) {
+        FlushTraceBuffer(data);
+        delete data->trace;
+        data->trace = NULL;
     }
 }
 
+/* ===================================================================== */
+/* Region of interest */
+/* ===================================================================== */
 
-VOID Syscall_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+VOID OpenRoi(THREADID tid)
 {
-    if (tid == _THREADID){
-       LoadSingleFast(iaddr,tid);
-       syscall_seen = true;
+    PIN_GetLock(&roi_lock, tid+1);
+    if (roi_state == ROI_WAITING) {
+        roi_state = ROI_OPEN;
+        PIN_RemoveInstrumentation();
     }
+    PIN_ReleaseLock(&roi_lock);
 }
 
-VOID Direct_Call_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+VOID CloseRoi(THREADID tid)
 {
-
-    if (tid == _THREADID){
-         LoadMultiFast(iaddr,size,tid);
-         call_instr_seen = true;
+    PIN_GetLock(&roi_lock, tid+1);
+    if (roi_state == ROI_OPEN) {
+        roi_state = ROI_CLOSED;
+        //the reports are written by Fini, or by DetachFini after a detach
+        if (roi_end == ROI_END_FLUSH)
+            PIN_RemoveInstrumentation();
+        else if (roi_end == ROI_END_DETACH)
+            PIN_Detach();
     }
+    PIN_ReleaseLock(&roi_lock);
 }
 
-VOID Direct_Jump_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+VOID RoiMarker(ADDRINT open, THREADID tid)
 {
-    if (tid == _THREADID){
-         LoadMultiFast(iaddr,size,tid);
-	 dir_jump_instr_seen = true;
-	 prev_dir_jump_page = (iaddr/4096);
-    }
+    if (open)
+        OpenRoi(tid);
+    else
+        CloseRoi(tid);
 }
 
-VOID Indirect_Call_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+// counts the instructions of a simulated thread before the window opens
+VOID CountSkipped(UINT32 count, THREADID tid)
 {
-    if (tid == _THREADID){
-         LoadMultiFast(iaddr,size,tid);
-         call_instr_seen = true;
-         ind_call_instr_seen = true;
-    }
+    thread_data* data = GetThreadData(tid);
+    if (data->sim == NULL)
+        return;
+    data->skipped += count;
+    if (data->skipped >= KnobRoiStart.Value())
+        OpenRoi(tid);
 }
 
-VOID Indirect_Jump_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+VOID ImageLoad(IMG img, VOID * v)
 {
-    if (tid == _THREADID){
-         LoadMultiFast(iaddr,size,tid);
-         ind_jump_seen = true;
-         prev_ind_jump_page = iaddr/4096;
+    const string names[] = { KnobRoiStartRoutine.Value(), KnobRoiStopRoutine.Value(),
+                             KnobRoiMarker.Value(), KnobThreadRoutine.Value() };
+    std::set<ADDRINT>* entries[] = { &roi_start_entries, &roi_stop_entries,
+                                     &roi_marker_entries, &thread_routine_entries };
+    for (UINT32 i = 0; i < 4; i++)
+    {
+        if (names[i].empty())
+            continue;
+        RTN rtn = RTN_FindByName(img, names[i].c_str());
+        if (RTN_Valid(rtn))
+            entries[i]->insert(RTN_Address(rtn));
     }
 }
 
-VOID Return_Instruction_Multiple(ADDRINT iaddr, UINT32 size, THREADID tid)
+// inserts the triggers of the current state and the thread selection by
+// routine, before the calls of the simulation so that they take effect at once
+VOID TriggerTrace(TRACE trace, VOID * v)
 {
+    const ROI_STATE state = roi_state;
+    if (state == ROI_CLOSED)
+        return;
 
-    if (tid == _THREADID){
-         LoadMultiFast(iaddr,size,tid);
-        // mapping_from_page_to_unique_cache_blocks_touched_on_function_return[iaddr/4096].insert(iaddr/64);
-         return_instr_seen = true;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        if (state == ROI_WAITING && KnobRoiStart.Value() != 0)
+            BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)CountSkipped,
+                           IARG_UINT32, BBL_NumIns(bbl),
+                           IARG_THREAD_ID, IARG_END);
+
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            const ADDRINT iaddr = INS_Address(ins);
+            if (state == ROI_WAITING && roi_start_entries.count(iaddr))
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)OpenRoi,
+                               IARG_THREAD_ID, IARG_END);
+            if (state == ROI_OPEN && roi_stop_entries.count(iaddr))
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)CloseRoi,
+                               IARG_THREAD_ID, IARG_END);
+            if (roi_marker_entries.count(iaddr))
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)RoiMarker,
+                               IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+                               IARG_THREAD_ID, IARG_END);
+            if (thread_routine_entries.count(iaddr))
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SelectThread,
+                               IARG_THREAD_ID, IARG_END);
+        }
     }
 }
 
-// The running count of instructions is kept here
-// make it static to help the compiler optimize docount
-static UINT64 icount = 0;
+/* ===================================================================== */
 
-// This function is called before every instruction is executed
-VOID docount(THREADID tid) { 
+VOID FetchInstruction(ADDRINT iaddr, UINT32 size, UINT32 kind, const function_symbol* function, THREADID tid)
+{
+    thread_data* data = GetThreadData(tid);
+    if (data->sim == NULL)
+        return;
+    if (function != NULL)
+        data->sim->SetFunction(function->id, function->entry);
+    data->sim->Fetch(iaddr, size, (FETCH_KIND)kind, data->schedule.Phase());
+}
+
+// counts one instruction of a simulated thread, after the reports and the
+// phase change due before it
+static inline VOID AdvanceInstruction(thread_data* data) { 
 	
-    if ((tid == _THREADID)){
 #ifdef ACTIVE_LOW_FUNCTION_LOGGING 
-	if ((icount%1000000) == 0){
+	if ((data->icount%1000000) == 0){
 	 uint64_t num_of_active_functions = 
-		 number_of_active_low_use_functions.size();
-	 list_of_active_low_use_function_counts.push_back(num_of_active_functions);	
+		 data->sim->number_of_active_low_use_functions.size();
+	 data->sim->list_of_active_low_use_function_counts.push_back(num_of_active_functions);	
 	}
 #endif	
-	if (icount == INSTRUCTION_THRESHOLD){
-         std::ofstream out(KnobOutputFile.Value().c_str());
-     
-         // print I-cache profile
-         // @todo what does this print
-         
-         out << "PIN:MEMLATENCIES 1.0. 0x0\n";
-                 
-         out <<
-             "#\n"
-             "# ICACHE stats\n"
-             "#\n";
-         
-         out << il1->StatsLong("# ", CACHE_BASE::CACHE_TYPE_ICACHE);
-         out <<
-             "#\n"
-             "# ITLB stats\n"
-             "#\n";
-     
-     
-         out << itlb->StatsLong("# ", CACHE_BASE::CACHE_TYPE_ICACHE);
-     
-         if (KnobTrackInsts) {
-             out <<
-                 "#\n"
-                 "# INST stats\n"
-                 "#\n";
-             
-             out << profile.StringLong();
-         }
-        // out<<"ITLB misses from different miss categories" <<endl;
-        // out<<"ITLB misses after call "<< itlb_misses_after_call <<endl;
-         out <<"Total misses :" <<total_misses <<endl;
-	 out <<"Misses from low degree of use functions (modifided cache): " << count_misses_from_low_degree_functions<< endl;
-	 out <<"Misses from low degree of use functions (normal cache): " << count_misses_from_low_degree_functions_normal_cache<< endl;
-	 out <<"Misses from low degree of use functions after call (modifided cache): " << count_missses_from_low_degree_functions_after_call<< endl;
-	 out <<"Misses from low degree of use functions after call (normal cache): " << count_missses_from_low_degree_functions_normal_cache_after_call<< endl;
-	 out <<"Misses from high degree of use functions (modifided cache): " << count_misses_from_high_degree_functions<< endl;
-	 out <<"Misses from high degree of use functions (normal cache): " << count_misses_from_high_degree_functions_normal_cache<< endl;
-	 out <<"Misses from medium degree of use functions (modifided cache): " << count_misses_from_medium_degree_functions<< endl;
-	 out <<"Misses from medium degree of use functions (normal cache): " << count_misses_from_medium_degree_functions_normal_cache<< endl;
-	 out <<"Cache blocks replaced from high use functions by high use functions: " << count_of_blocks_displaced_from_high_use_functions_by_high_use_functions << endl;
-    	out <<"Cache blocks replaced from high use functions by low use (<=1) functions: " << count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions << endl;
-    	out <<"Cache blocks replaced from high use functions by low use (<=2) functions: " << count_of_blocks_displaced_from_high_use_functions_by_low_use_two_functions << endl;
-    	out <<"Cache blocks replaced from high use functions by low use (<=1) functions in cascade: " << 
-		count_of_blocks_displaced_from_high_use_functions_by_low_use_one_functions_in_cascade << endl;
- 	out <<"Cache blocks replaced from low use functions by low use functions: " <<
-		count_of_low_use_displacing_low_use_functions <<endl;	
-	out <<"Total number of low degree of use functions: " << functions_with_low_use.size() <<endl;
-         out <<"Total number of functions: " << function_invocation_count.size() <<endl;
-         out <<"Set of functions on which we have a icache miss after direct call" << endl;
-         out <<"Number of low use functions allocated way0:" << count_of_low_use_allocated_way0 << endl;
-         out <<"Number of low use functions we encounter a miss on:" << total_misses_on_low_use_functions << endl;
-	 for(set<uint64_t>::const_iterator it = functions_with_low_use.begin();
-             it != functions_with_low_use.end(); ++it)
-         {
-            out <<  (*it) << "," <<endl;
-         }
-         out << endl;
-
-#ifdef PERLBENCH_DEBUG
-	 out <<"Number of cache blocks accessed by function of interest in perlbench" << 
-		number_of_cache_blocks_part_of_function_of_interest_perlbench.size() << endl; 
-	 out << "Cache block accessed is: {";
-	 for(set<uint64_t>::const_iterator it = number_of_cache_blocks_part_of_function_of_interest_perlbench.begin();
-             it != number_of_cache_blocks_part_of_function_of_interest_perlbench.end(); ++it)
-         {
-	    out <<  (*it) << ",";
-	 }
-	 out << endl;
-	 out <<"Number of instructions executed by function of interest in perlbench" << 
-		instructions_spent_in_function_of_interest << endl; 
-#endif	 
-	 out <<"Active low use function counts at different instants {";
-	 for(vector<uint64_t>::const_iterator it = list_of_active_low_use_function_counts.begin();
-             it != list_of_active_low_use_function_counts.end(); ++it){
-	    out <<  (*it) <<",";
-	 }
-	 out <<endl;
-	 for(map<uint64_t,function_stats>::const_iterator it = function_invocation_count.begin();
-             it != function_invocation_count.end(); ++it)
-         {
-             //print stats only for the pages that have more than a compulsory miss. 
-                     out << "("<< (it->first) <<"): " << " number_of_times_function_is_missed: "<< function_invocation_count[it->first].func_miss_count <<" number_of_total_misses_from_function:  "<<function_invocation_count[it->first].func_total_miss_count  <<" number_of_times_function_is_invoked: " <<function_invocation_count[it->first].func_invocation_count<<" number_of_function_itlb_misses: "<< function_invocation_count[it->first].func_total_itlb_miss_count<< endl;
-         }
-     
-         out<<"ICache misses from shared library "<< icache_misses_from_shared_library <<endl;
-         out.close();
+	if (data->icount == INSTRUCTION_THRESHOLD){
+         WriteReport(data->sim, ThreadReportName(data->tid));
+         data->reported = true;
 	 //special case SPEC programs were we sample the 0th thread. 
 	 //exit(0);
 	 //done = true;
         }
-	icount++;
+	if (data->icount == data->next_interval){
+	 WriteInterval(data, false);
+	 data->next_interval += KnobInterval.Value();
+	}
+	if (data->icount == data->schedule.NextChange())
+	 data->sim->ChangePhase(data->schedule);
+	data->icount++;
+}
+
+// counts one instruction of a simulated thread
+static inline VOID CountInstruction(thread_data* data) { 
+	
+	//this instruction is the first one after the window
+	if (data->icount == roi_stop_icount){
+	 CloseRoi(data->tid);
+	 return;
+	}
+	AdvanceInstruction(data);
+}
+
+
+// This function is called before every instruction is executed
+VOID docount(THREADID tid) { 
+    thread_data* data = GetThreadData(tid);
+    if (data->sim != NULL)
+        CountInstruction(data);
+}
+
+/* ===================================================================== */
+/* Basic block mode */
+/* ===================================================================== */
+
+struct block_fetch{
+	ADDRINT addr;
+	UINT32 size;
+	UINT32 kind;
+	const function_symbol* function;
+};
+
+//the instructions of one basic block, built when the block is instrumented
+//and kept for as long as the code may run
+struct basic_block{
+	UINT32 count;
+	block_fetch* fetches;
+};
+
+//blocks by the address of their first instruction. Code instrumented again,
+//after it left the code cache or the instrumentation was removed, reuses
+//its block, which analysis calls still queued may point to, so blocks are
+//never freed. Only code replaced at the same address adds another one.
+std::multimap<ADDRINT, basic_block*> blocks_by_address;
+
+// the block with these fetches, built on its first instrumentation
+static const basic_block* FindBlock(const std::vector<block_fetch> & fetches)
+{
+    typedef std::multimap<ADDRINT, basic_block*>::iterator BLOCK_ITERATOR;
+    const UINT32 count = fetches.size();
+    std::pair<BLOCK_ITERATOR, BLOCK_ITERATOR> range = blocks_by_address.equal_range(fetches[0].addr);
+    for (BLOCK_ITERATOR it = range.first; it != range.second; ++it)
+    {
+        const basic_block* block = it->second;
+        if (block->count != count)
+            continue;
+        UINT32 i = 0;
+        for (; i < count; i++)
+        {
+            const block_fetch & fetch = block->fetches[i];
+            if (fetch.addr != fetches[i].addr || fetch.size != fetches[i].size ||
+                fetch.kind != fetches[i].kind || fetch.function != fetches[i].function)
+                break;
+        }
+        if (i == count)
+            return block;
     }
- 
+
+    basic_block* block = new basic_block;
+    block->count = count;
+    block->fetches = new block_fetch[count];
+    for (UINT32 i = 0; i < count; i++)
+        block->fetches[i] = fetches[i];
+    blocks_by_address.insert(std::make_pair(fetches[0].addr, block));
+    return block;
+}
+
+// This function is called before every basic block is executed. It
+// replays, in order, exactly what docount, RecordFetch and FetchInstruction
+// do for each instruction in the per-instruction mode.
+VOID FetchBlock(const basic_block* block, THREADID tid)
+{
+    thread_data* data = GetThreadData(tid);
+    ICACHE_SIM* sim = data->sim;
+    const UINT32 count = block->count;
+
+    //the report and interval lines must be written, and the sampling phase
+    //changed, between the right two instructions. Any block that crosses
+    //none of these boundaries is counted at once.
+    bool counted = false;
+#ifndef ACTIVE_LOW_FUNCTION_LOGGING
+    if (sim != NULL && ((data->icount > INSTRUCTION_THRESHOLD) ||
+                        (data->icount + count <= INSTRUCTION_THRESHOLD)) &&
+        data->icount + count <= data->next_interval &&
+        data->icount + count <= data->schedule.NextChange() &&
+        data->icount + count <= roi_stop_icount){
+        data->icount += count;
+        counted = true;
+    }
+#endif
+    //a fast-forwarded block costs no more than its count
+    if (counted && data->trace == NULL && data->schedule.Phase() == SAMPLE_PHASE_FAST_FORWARD){
+        sim->FastForward(count);
+        return;
+    }
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        const block_fetch & fetch = block->fetches[i];
+        if (sim != NULL && !counted){
+            CountInstruction(data);
+            //the window may have closed at this instruction
+            if (roi_state != ROI_OPEN)
+                return;
+        }
+        if (data->trace != NULL)
+            AppendFetch(data, fetch.addr, fetch.size, fetch.kind, true, tid);
+        if (sim != NULL){
+            if (fetch.function != NULL)
+                sim->SetFunction(fetch.function->id, fetch.function->entry);
+            sim->Fetch(fetch.addr, fetch.size, (FETCH_KIND)fetch.kind, data->schedule.Phase());
+        }
+    }
+}
+
+/* ===================================================================== */
+/* Pipeline mode */
+/* ===================================================================== */
+
+//internal threads that simulate the queued fetches; application threads
+//are given to them round robin in the order they start
+std::vector<PIN_THREAD_UID> worker_uids;
+//set when the workers are to drain the rings one last time and end, and
+//once they have, so that no application thread waits on a full ring
+volatile bool workers_stop;
+volatile bool workers_done;
+
+// queues one instruction of a simulated thread, in the order and with the
+// same end of the window as CountInstruction and FetchInstruction
+// @return false when the window closed at this instruction
+static inline bool QueueInstruction(thread_data* data, ADDRINT iaddr, UINT32 size, UINT32 kind,
+                                    const function_symbol* function, BOOL executing)
+{
+    if (data->queued == roi_stop_icount){
+        CloseRoi(data->tid);
+        return false;
+    }
+    data->queued++;
+
+    const queued_fetch fetch = { iaddr, function, UINT8(size), UINT8(kind), UINT8(executing) };
+    //back-pressure: a thread that gets ahead of its worker waits for it
+    while (!data->ring->Push(fetch)){
+        if (workers_done)
+            return true;
+        PIN_Yield();
+    }
+    return true;
+}
+
+VOID QueueFetch(ADDRINT iaddr, UINT32 size, UINT32 kind, const function_symbol* function,
+                BOOL executing, THREADID tid)
+{
+    thread_data* data = GetThreadData(tid);
+    if (data->sim != NULL)
+        QueueInstruction(data, iaddr, size, kind, function, executing);
+}
+
+// the basic block mode equivalent of FetchBlock
+VOID QueueBlock(const basic_block* block, THREADID tid)
+{
+    thread_data* data = GetThreadData(tid);
+    for (UINT32 i = 0; i < block->count; i++)
+    {
+        const block_fetch & fetch = block->fetches[i];
+        if (data->sim != NULL &&
+            !QueueInstruction(data, fetch.addr, fetch.size, fetch.kind, fetch.function, true))
+            return;
+        if (data->trace != NULL)
+            AppendFetch(data, fetch.addr, fetch.size, fetch.kind, true, tid);
+    }
+}
+
+// simulates the queued fetches of one thread on its worker
+// @return the number of fetches taken from the ring
+static UINT32 DrainRing(thread_data* data)
+{
+    //a bounded share per visit keeps the other threads of the worker moving
+    const UINT32 share = KnobPipelineRing.Value();
+    queued_fetch fetch;
+    UINT32 count = 0;
+    for (; count < share && data->ring->Pop(fetch); count++)
+    {
+        //the simulator was created before the first fetch was queued
+        ICACHE_SIM* sim = data->sim;
+        AdvanceInstruction(data);
+        if (!fetch.executing)
+            continue;
+        if (fetch.function != NULL)
+            sim->SetFunction(fetch.function->id, fetch.function->entry);
+        sim->Fetch(fetch.addr, fetch.size, (FETCH_KIND)fetch.kind, data->schedule.Phase());
+    }
+    return count;
 }
 
+VOID PipelineWorker(VOID* arg)
+{
+    const UINT32 worker = static_cast<UINT32>(reinterpret_cast<ADDRINT>(arg));
+    const UINT32 workers = worker_uids.size();
+    const THREADID tid = PIN_ThreadId();
+    std::vector<thread_data*> threads;
+    UINT32 seen = 0;
+
+    for (;;)
+    {
+        //read before draining, so that the pass that finds every ring empty
+        //after the stop has seen all records queued before it
+        const bool stopping = workers_stop;
+
+        PIN_GetLock(&all_threads_lock, tid+1);
+        for (; seen < all_threads.size(); seen++)
+            if (all_threads[seen]->ring != NULL && seen % workers == worker)
+                threads.push_back(all_threads[seen]);
+        PIN_ReleaseLock(&all_threads_lock);
+
+        UINT32 drained = 0;
+        for (UINT32 i = 0; i < threads.size(); i++)
+            drained += DrainRing(threads[i]);
+        if (drained == 0){
+            if (stopping)
+                break;
+            PIN_Yield();
+        }
+    }
+}
+
+bool StartWorkers(UINT32 count)
+{
+    worker_uids.resize(count);
+    for (UINT32 i = 0; i < count; i++)
+        if (PIN_SpawnInternalThread(PipelineWorker, reinterpret_cast<VOID*>(ADDRINT(i)), 0,
+                                    &worker_uids[i]) == INVALID_THREADID)
+            return false;
+    return true;
+}
+
+// the final drain: lets the workers empty every ring and waits for them
+VOID StopWorkers()
+{
+    if (worker_uids.empty() || workers_done)
+        return;
+    workers_stop = true;
+    for (UINT32 i = 0; i < worker_uids.size(); i++)
+        PIN_WaitForThreadTermination(worker_uids[i], PIN_INFINITE_TIMEOUT, NULL);
+    workers_done = true;
+}
+
+VOID PrepareForFini(VOID * v)
+{
+    StopWorkers();
+    StopTraceWriter();
+}
 
 /* ===================================================================== */
 
+// classify the control transfer of an instruction. The order of the checks
+// differs between the single and multiple line cases and is kept as it was
+// when each case had its own set of analysis routines.
+FETCH_KIND ClassifyFetch(INS ins, BOOL single)
+{
+    if (single && INS_IsRet(ins))
+        return FETCH_KIND_RETURN;
+    if (INS_IsDirectControlFlow(ins))
+        return INS_IsCall(ins) ? FETCH_KIND_DIRECT_CALL : FETCH_KIND_DIRECT_JUMP;
+    if (INS_IsIndirectControlFlow(ins))
+        return INS_IsCall(ins) ? FETCH_KIND_INDIRECT_CALL : FETCH_KIND_INDIRECT_JUMP;
+    if (INS_IsRet(ins))
+        return FETCH_KIND_RETURN;
+    if (INS_IsSyscall(ins))
+        return FETCH_KIND_SYSCALL;
+    return FETCH_KIND_PLAIN;
+}
+
+// the symbol of the routine containing an instruction, NULL unless fetches
+// are attributed by symbol
+static const function_symbol* FindFunction(ADDRINT iaddr)
+{
+    if (!sim_config.symbol_functions)
+        return NULL;
+
+    RTN rtn = RTN_FindByAddress(iaddr);
+    const ADDRINT entry = RTN_Valid(rtn) ? RTN_Address(rtn) : 1;
+    std::map<ADDRINT, function_symbol*>::iterator it = function_symbols.find(entry);
+    if (it != function_symbols.end())
+        return it->second;
+
+    function_symbol* function = new function_symbol;
+    function->id = function_symbols.size();
+    function->entry = entry;
+    function_symbols[entry] = function;
+    if (RTN_Valid(rtn)){
+        const string image = IMG_Name(SEC_Img(RTN_Sec(rtn)));
+        function_names[entry] = image.substr(image.find_last_of('/') + 1) + ":" + RTN_Name(rtn);
+    }
+    return function;
+}
+
+// every analysis call is the Then call of an inlined IsActive check
+static VOID InsertIfActive(INS ins, BOOL predicated)
+{
+    if (predicated)
+        INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)IsActive,
+                                   IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_END);
+    else
+        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsActive,
+                         IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_END);
+}
+
 VOID Instruction(INS ins, void * v)
 {
-    
+    if (roi_state != ROI_OPEN)
+        return;
+
 //    // Insert a call to docount before every instruction, no arguments are passed
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, 
+    //with -pipeline the instruction is counted by its worker
+    if (!KnobPipeline.Value()) {
+        InsertIfActive(ins, false);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, 
 		    IARG_THREAD_ID, IARG_END);
+    }
     // map sparse INS addresses to dense IDs
     const ADDRINT iaddr = INS_Address(ins);
     const UINT32 instId = profile.Map(iaddr);
@@ -889,94 +1104,168 @@ VOID Instruction(INS ins, void * v)
     const BOOL   single = (size <= 4);
                 
     if (KnobTrackInsts) {
+        InsertIfActive(ins, true);
         if (single) {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingle,
+            INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingle,
                                      IARG_ADDRINT, iaddr,
                                      IARG_UINT32, instId,
+                                     IARG_THREAD_ID,
                                      IARG_END);
         }
         else {
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMulti,
-                                     IARG_UINT32, iaddr,
+            INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMulti,
+                                     IARG_ADDRINT, iaddr,
                                      IARG_UINT32, size,
                                      IARG_UINT32, instId,
+                                     IARG_THREAD_ID,
                                      IARG_END);
         }
+        return;
+    }
+
+    const FETCH_KIND kind = ClassifyFetch(ins, single);
+    const function_symbol* function = FindFunction(iaddr);
+
+    //the instruction is counted before it is recorded, as docount does
+    if (KnobPipeline.Value()) {
+        InsertIfActive(ins, false);
+        if (kind == FETCH_KIND_PLAIN)
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)QueueFetch,
+                               IARG_ADDRINT, iaddr,
+                               IARG_UINT32, size,
+                               IARG_UINT32, kind,
+                               IARG_PTR, function,
+                               IARG_EXECUTING,
+                               IARG_THREAD_ID, IARG_END);
+        else
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)QueueFetch,
+                               IARG_ADDRINT, iaddr,
+                               IARG_UINT32, size,
+                               IARG_UINT32, kind,
+                               IARG_PTR, function,
+                               IARG_BOOL, TRUE,
+                               IARG_THREAD_ID, IARG_END);
+    }
+
+    if (!KnobFetchTrace.Value().empty()) {
+        InsertIfActive(ins, false);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordFetch,
+                       IARG_ADDRINT, iaddr,
+                       IARG_UINT32, size,
+                       IARG_UINT32, kind,
+                       IARG_EXECUTING,
+                       IARG_THREAD_ID, IARG_END);
+    }
+    if (KnobPipeline.Value())
+        return;
+
+    //control transfers are always simulated, other instructions only
+    //when their predicate is true.
+    if (kind == FETCH_KIND_PLAIN) {
+        InsertIfActive(ins, true);
+        INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)FetchInstruction,
+                                     IARG_ADDRINT, iaddr,
+                                     IARG_UINT32, size,
+                                     IARG_UINT32, kind,
+                                     IARG_PTR, function,
+                                     IARG_THREAD_ID, IARG_END);
     }
     else {
-        if (single) {
-           if (INS_IsRet(ins)){
-                 INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Return_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-           }
-
-           else if(INS_IsDirectControlFlow(ins) ){
-             if( INS_IsCall(ins) )
-                 INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Direct_Call_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-             else
-              INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Direct_Jump_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-           }
-           else if (INS_IsIndirectControlFlow(ins)){
-             if( INS_IsCall(ins) )
-                   INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Indirect_Call_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-
-             else
-              INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Indirect_Jump_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-           }
-           else if(INS_IsSyscall(ins))
-           {
-               INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Syscall_Instruction_Single, IARG_UINT32, iaddr,
-                            IARG_THREAD_ID,  IARG_END);
-           }
-           else	       
-            INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadSingleFast,
-                                     IARG_UINT32, iaddr,
-				     IARG_THREAD_ID,
-                                     IARG_END);
+        InsertIfActive(ins, false);
+        INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)FetchInstruction,
+                           IARG_ADDRINT, iaddr,
+                           IARG_UINT32, size,
+                           IARG_UINT32, kind,
+                           IARG_PTR, function,
+                           IARG_THREAD_ID, IARG_END);
+    }
+}
+
+/* ===================================================================== */
+
+VOID Trace(TRACE trace, void * v)
+{
+    if (roi_state != ROI_OPEN)
+        return;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        //predicated instructions are only simulated when they execute,
+        //blocks containing them keep the per-instruction calls
+        BOOL predicated = false;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+            predicated |= INS_IsPredicated(ins);
+        if (predicated) {
+            for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+                Instruction(ins, v);
+            continue;
         }
-        else {
-           if(INS_IsDirectControlFlow(ins) ){
-             if( INS_IsCall(ins) )
-                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Direct_Call_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-             else
-             INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Direct_Jump_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-           }
-           else if (INS_IsIndirectControlFlow(ins)){
-             if( INS_IsCall(ins) )
-             INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Indirect_Call_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-             else
-             INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Indirect_Jump_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-           }
-
-           else if (INS_IsRet(ins)){
-             INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Return_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-           }
-           else if(INS_IsSyscall(ins))
-           {
-               INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)Syscall_Instruction_Multiple, IARG_UINT32, iaddr,
-                            IARG_UINT32, size,IARG_THREAD_ID,  IARG_END);
-           }
-           else            
-		INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) LoadMultiFast,
-                                     IARG_UINT32, iaddr,
-                                     IARG_UINT32, size,
-				     IARG_THREAD_ID,
-                                     IARG_END);
+
+        std::vector<block_fetch> fetches(BBL_NumIns(bbl));
+        UINT32 i = 0;
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins), i++)
+        {
+            block_fetch & fetch = fetches[i];
+            fetch.addr = INS_Address(ins);
+            fetch.size = INS_Size(ins);
+            fetch.kind = ClassifyFetch(ins, fetch.size <= 4);
+            fetch.function = FindFunction(fetch.addr);
         }
+        const basic_block* block = FindBlock(fetches);
+
+        BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)IsActive,
+                         IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_END);
+        BBL_InsertThenCall(bbl, IPOINT_BEFORE,
+                           KnobPipeline.Value() ? (AFUNPTR)QueueBlock : (AFUNPTR)FetchBlock,
+                           IARG_PTR, block,
+                           IARG_THREAD_ID, IARG_END);
     }
 }
 
 /* ===================================================================== */
 
+// writes every report once, at exit or after a detach
+VOID WriteFinalReports()
+{
+    static bool written = false;
+    if (written)
+        return;
+    written = true;
+
+    //the workers finish the fetches still queued before anything is reported
+    StopWorkers();
+
+    //threads still running at a detach have records left in their buffers
+    for (UINT32 i = 0; i < all_threads.size(); i++)
+        if (all_threads[i]->trace != NULL)
+            FlushTraceBuffer(all_threads[i]);
+    StopTraceWriter();
+    trace_writer.Close();
+
+    //threads that never reached the threshold are reported with their final
+    //state, and all simulated threads together in the merged report
+    ICACHE_SIM* merged = new ICACHE_SIM(sim_config);
+    for (UINT32 i = 0; i < all_threads.size(); i++)
+    {
+        thread_data* data = all_threads[i];
+        if (data->sim == NULL)
+            continue;
+        data->sim->EndStream(data->schedule, data->icount);
+        if (!data->reported)
+            WriteReport(data->sim, ThreadReportName(data->tid));
+        if (KnobInterval.Value())
+            WriteInterval(data, true);
+        merged->Merge(*data->sim);
+    }
+    WriteReport(merged, KnobOutputFile.Value());
+    delete merged;
+    interval_out.close();
+}
+
+VOID DetachFini(VOID * v)
+{
+    WriteFinalReports();
+}
+
 VOID Fini(int code, VOID * v)
 {
 
@@ -1080,7 +1369,8 @@ VOID Fini(int code, VOID * v)
    //  	 out <<"Working set size is: " <<working_set_size << endl;
    //      out<<"ICache misses from shared library "<< icache_misses_from_shared_library <<endl;
    //      out.close();
-    
+
+    WriteFinalReports();
 }
 
 /* ===================================================================== */
@@ -1094,15 +1384,141 @@ int main(int argc, char *argv[])
         return Usage();
     }
 
-    il1 = new IL1::CACHE("L1 Inst Cache",
-                         KnobCacheSize.Value() * KILO,
-                         KnobLineSize.Value(),
-                         KnobAssociativity.Value());
+    sim_config.il1_size = KnobCacheSize.Value() * KILO;
+    sim_config.il1_line_size = KnobLineSize.Value();
+    sim_config.il1_associativity = KnobAssociativity.Value();
+    sim_config.itlb_size = KnobITLBSize.Value() * KILO;
+    sim_config.itlb_line_size = KnobITLBLineSize.Value();
+    sim_config.itlb_associativity = KnobITLBAssociativity.Value();
+    sim_config.l2_size = KnobL2Size.Value() * KILO;
+    sim_config.l2_line_size = KnobL2LineSize.Value();
+    sim_config.l2_associativity = KnobL2Associativity.Value();
+    sim_config.llc_size = KnobLLCSize.Value() * KILO;
+    sim_config.llc_line_size = KnobLLCLineSize.Value();
+    sim_config.llc_associativity = KnobLLCAssociativity.Value();
+    if (!ValidLineSize(sim_config.il1_line_size) || !ValidLineSize(sim_config.itlb_line_size) ||
+        !ValidLineSize(sim_config.l2_line_size) || !ValidLineSize(sim_config.llc_line_size)) {
+        cerr << "Block sizes must be powers of two of at least " << MIN_LINE_SIZE << " bytes" << endl;
+        return Usage();
+    }
+    if (!ParseInclusionPolicy(KnobInclusion.Value(), sim_config.inclusion)) {
+        cerr << "Unknown inclusion policy " << KnobInclusion.Value() << endl;
+        return Usage();
+    }
+    if (!ParsePageSize(KnobPageSize.Value(), sim_config.tlb.page_size)) {
+        cerr << "Unknown page size " << KnobPageSize.Value() << endl;
+        return Usage();
+    }
+    sim_config.tlb.itlb_entries = KnobTLBEntries.Value();
+    sim_config.tlb.itlb_associativity = KnobTLBAssociativity.Value();
+    sim_config.tlb.stlb_entries = KnobSTLBEntries.Value();
+    sim_config.tlb.stlb_associativity = KnobSTLBAssociativity.Value();
+    sim_config.tlb.stlb_latency = KnobSTLBLatency.Value();
+    sim_config.tlb.walk_level_latency = KnobWalkLatency.Value();
+    sim_config.timing.enabled = KnobTiming;
+    sim_config.timing.latency[LOWER_LEVEL_L2] = KnobL2Latency.Value();
+    sim_config.timing.latency[LOWER_LEVEL_LLC] = KnobLLCLatency.Value();
+    sim_config.timing.latency[LOWER_LEVEL_NUM] = KnobMemoryLatency.Value();
+    sim_config.timing.overlap_bbl = KnobOverlapBBL;
+    if (!ParsePrefetcher(KnobPrefetcher.Value(), sim_config.prefetch.kind)) {
+        cerr << "Unknown prefetcher " << KnobPrefetcher.Value() << endl;
+        return Usage();
+    }
+    sim_config.prefetch.degree = KnobPrefetchDegree.Value();
+    sim_config.prefetch.latency = KnobPrefetchLatency.Value();
+    sim_config.sampling.period = KnobSamplePeriod.Value();
+    sim_config.sampling.warming = KnobSampleWarming.Value();
+    sim_config.sampling.detailed = KnobSampleDetailed.Value();
+    if (!ValidSampling(sim_config.sampling)) {
+        cerr << "Warming and detailed intervals must fit in the sampling period" << endl;
+        return Usage();
+    }
+    sim_config.sweep_sizes = KnobSweepSizes.Value();
+    sim_config.sweep_associativities = KnobSweepAssociativities.Value();
+    sim_config.sweep_line_sizes = KnobSweepLineSizes.Value();
+    if (!ParseFootprintCounting(KnobFootprint.Value(), sim_config.approximate_footprint)) {
+        cerr << "Unknown footprint counting " << KnobFootprint.Value() << endl;
+        return Usage();
+    }
+    sim_config.call_stack_depth = KnobCallStackDepth.Value();
+    sim_config.profile_period = KnobProfile.Value();
+    if (KnobFunctions.Value() == "symbols") {
+        sim_config.symbol_functions = true;
+        sim_config.function_names = &function_names;
+    }
+    else if (KnobFunctions.Value() == "calls") {
+        sim_config.symbol_functions = false;
+        sim_config.function_names = NULL;
+    }
+    else {
+        cerr << "Unknown function attribution " << KnobFunctions.Value() << endl;
+        return Usage();
+    }
+
+    if (!STATS_WRITER::ParseFormat(KnobFormat.Value(), report_format)) {
+        cerr << "Unknown report format " << KnobFormat.Value() << endl;
+        return Usage();
+    }
 
-    itlb = new ITLB::CACHE("ITLB",
-                         KnobITLBSize.Value() * KILO,
-                         KnobITLBLineSize.Value(),
-                         KnobITLBAssociativity.Value());
+    if (KnobRoiEnd.Value() == "flush")
+        roi_end = ROI_END_FLUSH;
+    else if (KnobRoiEnd.Value() == "detach")
+        roi_end = ROI_END_DETACH;
+    else if (KnobRoiEnd.Value() == "keep")
+        roi_end = ROI_END_KEEP;
+    else {
+        cerr << "Unknown end of the region of interest " << KnobRoiEnd.Value() << endl;
+        return Usage();
+    }
+    const bool roi_routines = !KnobRoiStartRoutine.Value().empty() ||
+                              !KnobRoiStopRoutine.Value().empty() ||
+                              !KnobRoiMarker.Value().empty() ||
+                              !KnobThreadRoutine.Value().empty();
+    const bool roi_waits = KnobRoiStart.Value() != 0 ||
+                           !KnobRoiStartRoutine.Value().empty() ||
+                           !KnobRoiMarker.Value().empty();
+    roi_state = roi_waits ? ROI_WAITING : ROI_OPEN;
+    roi_stop_icount = KnobRoiLength.Value() ? KnobRoiLength.Value() : ~UINT64(0);
+    PIN_InitLock(&roi_lock);
+
+    //the per-instruction profile is kept on the application threads
+    if (KnobPipeline.Value() && KnobTrackInsts) {
+        cerr << "-pipeline cannot be combined with -ti" << endl;
+        return Usage();
+    }
+
+    if (KnobThreads.Value() != "all")
+        simulated_threads = ParseNumberList(KnobThreads.Value());
+    if (!KnobThreadOrder.Value().empty())
+        simulated_thread_order = ParseNumberList(KnobThreadOrder.Value());
+
+    thread_key = PIN_CreateThreadDataKey(NULL);
+    PIN_InitLock(&all_threads_lock);
+
+    if (!KnobFetchTrace.Value().empty()) {
+        const string format = KnobFetchTraceFormat.Value();
+        if (format != "chunked" && format != "raw") {
+            cerr << "Unknown -trace_format " << format << endl;
+            return -1;
+        }
+        if (!trace_writer.Open(KnobFetchTrace.Value().c_str(), format == "chunked")) {
+            cerr << "Could not open fetch trace " << KnobFetchTrace.Value() << endl;
+            return -1;
+        }
+        PIN_InitLock(&trace_lock);
+    }
+    if (KnobInterval.Value()) {
+        string name = KnobIntervalFile.Value();
+        if (name.empty())
+            name = KnobOutputFile.Value() + ".intervals";
+        interval_out.open(name.c_str());
+        if (!interval_out) {
+            cerr << "Could not open interval file " << name << endl;
+            return -1;
+        }
+        ICACHE_SIM::WriteIntervalHeader(interval_out);
+        PIN_InitLock(&interval_lock);
+    }
     profile.SetKeyName("iaddr          ");
     profile.SetCounterName("icache:miss        icache:hit");
 
@@ -1113,8 +1529,30 @@ int main(int argc, char *argv[])
     
     profile.SetThreshold( threshold );
     
-    INS_AddInstrumentFunction(Instruction, 0);
+    //the triggers of the region of interest go before the simulation calls
+    if (roi_routines)
+        IMG_AddInstrumentFunction(ImageLoad, 0);
+    TRACE_AddInstrumentFunction(TriggerTrace, 0);
+
+    //the per-instruction profile of -insts needs per-instruction calls
+    if (KnobBasicBlocks && !KnobTrackInsts)
+        TRACE_AddInstrumentFunction(Trace, 0);
+    else
+        INS_AddInstrumentFunction(Instruction, 0);
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
     PIN_AddFiniFunction(Fini, 0);
+    PIN_AddDetachFunction(DetachFini, 0);
+
+    if (KnobPipeline.Value() && !StartWorkers(KnobPipeline.Value())) {
+        cerr << "Could not start the pipeline workers" << endl;
+        return -1;
+    }
+    if (!KnobFetchTrace.Value().empty() && !StartTraceWriter()) {
+        cerr << "Could not start the trace writer" << endl;
+        return -1;
+    }
 
     // Never returns
 
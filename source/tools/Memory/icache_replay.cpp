@@ -0,0 +1,758 @@
+/*BEGIN_LEGAL 
+Intel Open Source License 
+
+Copyright (c) 2002-2017 Intel Corporation. All rights reserved.
+ 
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.  Redistributions
+in binary form must reproduce the above copyright notice, this list of
+conditions and the following disclaimer in the documentation and/or
+other materials provided with the distribution.  Neither the name of
+the Intel Corporation nor the names of its contributors may be used to
+endorse or promote products derived from this software without
+specific prior written permission.
+ 
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE INTEL OR
+ITS CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+END_LEGAL */
+/*! @file
+ *  Offline replay of fetch traces recorded with the icache pintool
+ *  (-trace). Feeds the recorded stream through the same ICACHE_SIM used by
+ *  the pintool, without Pin, so new cache configurations can be simulated
+ *  at native speed. Build as a normal executable, e.g.
+ *
+ *    g++ -O2 -pthread -o icache_replay icache_replay.cpp
+ *
+ *  With -shards, only the IL1 geometry is simulated, as one cache shared by
+ *  the replayed threads whose sets are partitioned across worker threads.
+ *  Chunked traces are mapped into memory and, with -decoders, decoded
+ *  ahead of the simulation on worker threads.
+ */
+
+#include "pin_shim.H"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+
+#include "icache_sim.H"
+#include "sharded_cache.H"
+
+using std::cerr;
+using std::endl;
+using std::map;
+
+#define REPLAY_BUFFER_RECORDS 65536
+
+struct replay_options{
+	const char * trace;
+	string output;
+	UINT32 cache_size;
+	UINT32 line_size;
+	UINT32 associativity;
+	UINT32 itlb_size;
+	UINT32 itlb_line_size;
+	UINT32 itlb_associativity;
+	UINT32 l2_size;
+	UINT32 l2_line_size;
+	UINT32 l2_associativity;
+	UINT32 llc_size;
+	UINT32 llc_line_size;
+	UINT32 llc_associativity;
+	INCLUSION_POLICY inclusion;
+	tlb_config tlb;
+	timing_config timing;
+	prefetch_config prefetch;
+	sampling_config sampling;
+	UINT64 roi_start;
+	UINT64 roi_length;
+	string threads;
+	string thread_order;
+	string sweep_sizes;
+	string sweep_associativities;
+	string sweep_line_sizes;
+	bool approximate_footprint;
+	UINT32 call_stack_depth;
+	UINT32 profile;
+	UINT32 shards;
+	UINT64 seek;
+	UINT32 decoders;
+	STATS_WRITER::FORMAT format;
+	UINT64 interval;
+	string interval_output;
+};
+
+static int Usage(const char * prog)
+{
+    cerr << "usage: " << prog << " -t <trace> [options]\n"
+            "  -o <file>   output file (default icache_replay.out)\n"
+            "  -c <kb>     cache size in kilobytes (default 32)\n"
+            "  -b <bytes>  cache block size in bytes (default 64)\n"
+            "  -a <ways>   cache associativity (default 8)\n"
+            "  -ci <kb>    ITLB cache size in kilobytes (default 32)\n"
+            "  -bi <bytes> ITLB cache block size in bytes (default 64)\n"
+            "  -ai <ways>  ITLB cache associativity (default 8)\n"
+            "  -c2 <kb>    L2 size in kilobytes, 0 for no L2 (default 0)\n"
+            "  -b2 <bytes> L2 block size in bytes (default 64)\n"
+            "  -a2 <ways>  L2 associativity (default 8)\n"
+            "  -c3 <kb>    LLC size in kilobytes, 0 for no LLC (default 0)\n"
+            "  -b3 <bytes> LLC block size in bytes (default 64)\n"
+            "  -a3 <ways>  LLC associativity (default 16)\n"
+            "              block sizes are powers of two of at least 4 bytes\n"
+            "  -inclusion <noninclusive|inclusive|exclusive>  L2/LLC fill policy (default noninclusive)\n"
+            "  -page <4k|2m|1g>  page size of the code for the TLB model (default 4k)\n"
+            "  -tlb_i <n>  first level ITLB entries, 0 for no TLB model (default 128)\n"
+            "  -tlb_ia <ways>  first level ITLB associativity (default 8)\n"
+            "  -tlb_s <n>  second level TLB entries (default 1536)\n"
+            "  -tlb_sa <ways>  second level TLB associativity (default 12)\n"
+            "  -tlb_s_lat <cycles>  second level TLB lookup (default 9)\n"
+            "  -walk_lat <cycles>  per page table level of a walk (default 8)\n"
+            "  -timing <0|1>  estimate front-end stall cycles (default 0)\n"
+            "  -lat_l2 <cycles>  IL1 miss served by the L2 (default 14)\n"
+            "  -lat_llc <cycles>  IL1 miss served by the LLC (default 40)\n"
+            "  -lat_mem <cycles>  IL1 miss served by memory (default 200)\n"
+            "  -overlap_bbl <0|1>  charge only the longest stall of a basic block (default 0)\n"
+            "  -prefetch <none|next|fdip|callret>  instruction prefetcher (default none)\n"
+            "  -pf_degree <n>  lines or blocks prefetched per trigger (default 2)\n"
+            "  -pf_latency <n>  instructions until a prefetch arrives (default 20)\n"
+            "  -sample_period <n>  instructions per sampling period (default 0, no sampling)\n"
+            "  -sample_warming <n>  functional warming before each detailed interval (default 2000000)\n"
+            "  -sample_detailed <n>  detailed instructions at the end of each period (default 1000000)\n"
+            "  -roi_start <n>  records of a thread before the region of interest (default 0)\n"
+            "  -roi_length <n>  records of a thread in the region of interest (default 0, until the end)\n"
+            "  -tid <list> threads to simulate, or all (default all)\n"
+            "  -thread_order <list>  also simulate the threads first seen in these positions, 0 first\n"
+            "  -sweep_c <list>  IL1 sizes in kilobytes for a single-pass LRU sweep\n"
+            "  -sweep_a <list>  associativities for the sweep (default 1,2,4,8,16)\n"
+            "  -sweep_b <list>  block sizes for the sweep (default 64)\n"
+            "  -footprint <exact|approx>  per-function footprint counting (default exact)\n"
+            "  -call_stack_depth <n>      frames of the shadow call stack (default 1024)\n"
+            "  -profile <n>  time the simulation stages on one fetch in n and report them\n"
+            "                with memory high-water marks, 0 for none (default 0)\n"
+            "  -shards <n>  simulate only the IL1 geometry, shared by the threads, on n worker\n"
+            "               threads that each own a part of its sets; a power of two (default 0)\n"
+            "  -seek <n>   start at the n-th record of the trace, over all threads (default 0)\n"
+            "  -decoders <n>  chunks of a chunked trace decoded at once on worker threads (default 1)\n"
+            "  -format <text|jsonl|csv|binary>  report format (default text)\n"
+            "  -interval <n>  write counter deltas every n instructions (default 0, none)\n"
+            "  -interval_o <file>  interval output file (default <o>.intervals)\n";
+    return 1;
+}
+
+static bool ParseOptions(int argc, char * argv[], replay_options & opts)
+{
+    opts.trace = NULL;
+    opts.output = "icache_replay.out";
+    opts.cache_size = 32;
+    opts.line_size = 64;
+    opts.associativity = 8;
+    opts.itlb_size = 32;
+    opts.itlb_line_size = 64;
+    opts.itlb_associativity = 8;
+    opts.l2_size = 0;
+    opts.l2_line_size = 64;
+    opts.l2_associativity = 8;
+    opts.llc_size = 0;
+    opts.llc_line_size = 64;
+    opts.llc_associativity = 16;
+    opts.inclusion = INCLUSION_NON_INCLUSIVE;
+    opts.tlb.page_size = PAGE_SIZE_4K;
+    opts.tlb.itlb_entries = 128;
+    opts.tlb.itlb_associativity = 8;
+    opts.tlb.stlb_entries = 1536;
+    opts.tlb.stlb_associativity = 12;
+    opts.tlb.stlb_latency = 9;
+    opts.tlb.walk_level_latency = 8;
+    opts.timing.enabled = false;
+    opts.timing.latency[LOWER_LEVEL_L2] = 14;
+    opts.timing.latency[LOWER_LEVEL_LLC] = 40;
+    opts.timing.latency[LOWER_LEVEL_NUM] = 200;
+    opts.timing.overlap_bbl = false;
+    opts.prefetch.kind = PREFETCHER_NONE;
+    opts.prefetch.degree = 2;
+    opts.prefetch.latency = 20;
+    opts.sampling.period = 0;
+    opts.sampling.warming = 2000000;
+    opts.sampling.detailed = 1000000;
+    opts.roi_start = 0;
+    opts.roi_length = 0;
+    opts.threads = "all";
+    opts.thread_order = "";
+    opts.sweep_associativities = "1,2,4,8,16";
+    opts.sweep_line_sizes = "64";
+    opts.approximate_footprint = false;
+    opts.call_stack_depth = 1024;
+    opts.profile = 0;
+    opts.shards = 0;
+    opts.seek = 0;
+    opts.decoders = 1;
+    opts.format = STATS_WRITER::FORMAT_TEXT;
+    opts.interval = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (i + 1 >= argc)
+            return false;
+        const char * value = argv[i+1];
+        if (!strcmp(argv[i], "-t"))
+            opts.trace = value;
+        else if (!strcmp(argv[i], "-o"))
+            opts.output = value;
+        else if (!strcmp(argv[i], "-c"))
+            opts.cache_size = atoi(value);
+        else if (!strcmp(argv[i], "-b"))
+            opts.line_size = atoi(value);
+        else if (!strcmp(argv[i], "-a"))
+            opts.associativity = atoi(value);
+        else if (!strcmp(argv[i], "-ci"))
+            opts.itlb_size = atoi(value);
+        else if (!strcmp(argv[i], "-bi"))
+            opts.itlb_line_size = atoi(value);
+        else if (!strcmp(argv[i], "-ai"))
+            opts.itlb_associativity = atoi(value);
+        else if (!strcmp(argv[i], "-c2"))
+            opts.l2_size = atoi(value);
+        else if (!strcmp(argv[i], "-b2"))
+            opts.l2_line_size = atoi(value);
+        else if (!strcmp(argv[i], "-a2"))
+            opts.l2_associativity = atoi(value);
+        else if (!strcmp(argv[i], "-c3"))
+            opts.llc_size = atoi(value);
+        else if (!strcmp(argv[i], "-b3"))
+            opts.llc_line_size = atoi(value);
+        else if (!strcmp(argv[i], "-a3"))
+            opts.llc_associativity = atoi(value);
+        else if (!strcmp(argv[i], "-inclusion")){
+            if (!ParseInclusionPolicy(value, opts.inclusion))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-page")){
+            if (!ParsePageSize(value, opts.tlb.page_size))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-tlb_i"))
+            opts.tlb.itlb_entries = atoi(value);
+        else if (!strcmp(argv[i], "-tlb_ia"))
+            opts.tlb.itlb_associativity = atoi(value);
+        else if (!strcmp(argv[i], "-tlb_s"))
+            opts.tlb.stlb_entries = atoi(value);
+        else if (!strcmp(argv[i], "-tlb_sa"))
+            opts.tlb.stlb_associativity = atoi(value);
+        else if (!strcmp(argv[i], "-tlb_s_lat"))
+            opts.tlb.stlb_latency = atoi(value);
+        else if (!strcmp(argv[i], "-walk_lat"))
+            opts.tlb.walk_level_latency = atoi(value);
+        else if (!strcmp(argv[i], "-timing"))
+            opts.timing.enabled = atoi(value) != 0;
+        else if (!strcmp(argv[i], "-lat_l2"))
+            opts.timing.latency[LOWER_LEVEL_L2] = atoi(value);
+        else if (!strcmp(argv[i], "-lat_llc"))
+            opts.timing.latency[LOWER_LEVEL_LLC] = atoi(value);
+        else if (!strcmp(argv[i], "-lat_mem"))
+            opts.timing.latency[LOWER_LEVEL_NUM] = atoi(value);
+        else if (!strcmp(argv[i], "-overlap_bbl"))
+            opts.timing.overlap_bbl = atoi(value) != 0;
+        else if (!strcmp(argv[i], "-prefetch")){
+            if (!ParsePrefetcher(value, opts.prefetch.kind))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-pf_degree"))
+            opts.prefetch.degree = atoi(value);
+        else if (!strcmp(argv[i], "-pf_latency"))
+            opts.prefetch.latency = atoi(value);
+        else if (!strcmp(argv[i], "-sample_period"))
+            opts.sampling.period = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-sample_warming"))
+            opts.sampling.warming = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-sample_detailed"))
+            opts.sampling.detailed = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-roi_start"))
+            opts.roi_start = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-roi_length"))
+            opts.roi_length = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-tid"))
+            opts.threads = value;
+        else if (!strcmp(argv[i], "-thread_order"))
+            opts.thread_order = value;
+        else if (!strcmp(argv[i], "-sweep_c"))
+            opts.sweep_sizes = value;
+        else if (!strcmp(argv[i], "-sweep_a"))
+            opts.sweep_associativities = value;
+        else if (!strcmp(argv[i], "-sweep_b"))
+            opts.sweep_line_sizes = value;
+        else if (!strcmp(argv[i], "-footprint")){
+            if (!ParseFootprintCounting(value, opts.approximate_footprint))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-call_stack_depth"))
+            opts.call_stack_depth = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "-profile"))
+            opts.profile = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "-shards"))
+            opts.shards = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "-seek"))
+            opts.seek = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-decoders"))
+            opts.decoders = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "-format")){
+            if (!STATS_WRITER::ParseFormat(value, opts.format))
+                return false;
+        }
+        else if (!strcmp(argv[i], "-interval"))
+            opts.interval = strtoull(value, NULL, 10);
+        else if (!strcmp(argv[i], "-interval_o"))
+            opts.interval_output = value;
+        else
+            return false;
+        i++;
+    }
+    return opts.trace != NULL && opts.decoders != 0 && ValidSampling(opts.sampling) &&
+        ValidLineSize(opts.line_size) && ValidLineSize(opts.itlb_line_size) &&
+        ValidLineSize(opts.l2_line_size) && ValidLineSize(opts.llc_line_size);
+}
+
+static void WriteReport(ICACHE_SIM & sim, const string & name, STATS_WRITER::FORMAT format)
+{
+    if (format != STATS_WRITER::FORMAT_TEXT){
+        STATS_WRITER writer;
+        if (!writer.Open(name.c_str(), format))
+            cerr << "Could not open report " << name << endl;
+        else
+            sim.WriteStats(writer);
+        return;
+    }
+
+    std::ofstream out(name.c_str());
+    sim.PrintCacheStats(out);
+    sim.PrintFunctionStats(out);
+    out.close();
+}
+
+//per-thread replay state, mirroring thread_data in the pintool
+struct replay_thread{
+	ICACHE_SIM* sim;
+	UINT64 icount;
+	bool reported;
+	UINT64 next_interval;
+	SAMPLE_SCHEDULE schedule;
+	UINT64 skipped;
+};
+
+static void StartThread(replay_thread & thread, const icache_config & config, UINT64 first_interval)
+{
+    thread.sim = new ICACHE_SIM(config);
+    thread.icount = 0;
+    thread.reported = false;
+    thread.next_interval = first_interval;
+    thread.skipped = 0;
+    thread.schedule = SAMPLE_SCHEDULE(config.sampling);
+    if (thread.schedule.Enabled() && thread.schedule.Phase() == SAMPLE_PHASE_DETAILED)
+        thread.sim->BeginSample();
+}
+
+static string ThreadReportName(const replay_options & opts, UINT32 tid)
+{
+    return opts.output + "." + decstr(tid);
+}
+
+/* ===================================================================== */
+/* Parallel decoding */
+/* ===================================================================== */
+
+struct decode_job{
+	const FETCH_TRACE_READER * reader;
+	UINT32 chunk;
+	std::vector<fetch_record> records;
+	bool decoded;
+	bool running;
+	pthread_t thread;
+};
+
+static void * DecodeChunk(void * arg)
+{
+    decode_job * job = static_cast<decode_job *>(arg);
+    const FETCH_TRACE_READER & reader = *job->reader;
+    job->records.resize(reader.Chunk(job->chunk).records);
+    job->decoded = job->records.empty() || reader.DecodeChunk(job->chunk, &job->records[0]);
+    return NULL;
+}
+
+/*!
+ *  @brief Reads a trace like FETCH_TRACE_READER::Read. The chunks of a
+ *  chunked trace are decoded in batches of one chunk per decoder thread,
+ *  the next batch while the records of the last one are replayed.
+ */
+class TRACE_INPUT
+{
+  private:
+    FETCH_TRACE_READER & _reader;
+    //the batch being read, and the one being decoded
+    std::vector<decode_job> _ready;
+    std::vector<decode_job> _pending;
+    UINT32 _ready_count;
+    UINT32 _pending_count;
+    UINT32 _job;
+    size_t _next;
+    UINT32 _next_chunk;
+    bool _started;
+    bool _failed;
+
+    void WaitBatch()
+    {
+        for (UINT32 i = 0; i < _pending_count; i++)
+            if (_pending[i].running){
+                pthread_join(_pending[i].thread, NULL);
+                _pending[i].running = false;
+            }
+    }
+
+    void StartBatch()
+    {
+        _pending_count = std::min<UINT32>(_pending.size(), _reader.Chunks() - _next_chunk);
+        for (UINT32 i = 0; i < _pending_count; i++){
+            decode_job & job = _pending[i];
+            job.reader = &_reader;
+            job.chunk = _next_chunk++;
+            job.running = (pthread_create(&job.thread, NULL, DecodeChunk, &job) == 0);
+            if (!job.running)
+                DecodeChunk(&job);
+        }
+    }
+
+    // waits for the pending batch and starts decoding the one after it
+    void NextBatch()
+    {
+        WaitBatch();
+        _ready.swap(_pending);
+        _ready_count = _pending_count;
+        _job = 0;
+        _next = 0;
+        StartBatch();
+    }
+
+  public:
+    TRACE_INPUT(FETCH_TRACE_READER & reader, UINT32 decoders)
+        : _reader(reader), _ready(decoders), _pending(decoders), _ready_count(0), _pending_count(0),
+          _job(0), _next(0), _next_chunk(0), _started(false), _failed(false)
+    {
+        for (UINT32 i = 0; i < decoders; i++)
+            _ready[i].running = _pending[i].running = false;
+    }
+
+    ~TRACE_INPUT() { WaitBatch(); }
+
+    bool Failed() const { return _failed || _reader.Failed(); }
+
+    size_t Read(fetch_record * buffer, size_t count)
+    {
+        if (_ready.size() == 1 || !_reader.Chunked())
+            return _reader.Read(buffer, count);
+        //the rest of the chunk a seek positioned the reader in
+        if (_reader.Buffered() != 0)
+            return _reader.Read(buffer, std::min(count, _reader.Buffered()));
+        if (!_started){
+            _started = true;
+            _next_chunk = _reader.NextChunk();
+            StartBatch();
+        }
+
+        size_t read = 0;
+        while (read < count && !_failed){
+            if (_job == _ready_count){
+                if (_pending_count == 0)
+                    break;
+                NextBatch();
+                continue;
+            }
+            const decode_job & job = _ready[_job];
+            if (!job.decoded){
+                _failed = true;
+                break;
+            }
+            const size_t n = std::min(count - read, job.records.size() - _next);
+            memcpy(buffer + read, &job.records[_next], n * sizeof(fetch_record));
+            _next += n;
+            read += n;
+            if (_next == job.records.size()){
+                _job++;
+                _next = 0;
+            }
+        }
+        return read;
+    }
+};
+
+/* ===================================================================== */
+/* Sharded replay */
+/* ===================================================================== */
+
+//sized for LLC and ITLB geometries, the shards hold a part of the sets
+typedef CACHE_ROUND_ROBIN_REPLACEMENT(ITLB::max_sets, IL1::max_associativity, IL1_REPLACEMENT,
+                                      CACHE_ALLOC::STORE_ALLOCATE) SHARD_CACHE;
+typedef SHARDED_CACHE<SHARD_CACHE> SHARDED_IL1;
+
+#define SHARD_RING_RECORDS 16384
+
+struct shard_worker{
+	SHARDED_IL1 * cache;
+	UINT32 shard;
+};
+
+static void YieldThread()
+{
+    sched_yield();
+}
+
+static void * RunShard(void * arg)
+{
+    shard_worker * worker = static_cast<shard_worker *>(arg);
+    worker->cache->RunShard(worker->shard);
+    return NULL;
+}
+
+// every executed record of the selected threads is fetched from one IL1,
+// with the line rule of ICACHE_SIM::Fetch
+static int ReplaySharded(TRACE_INPUT & input, const replay_options & opts)
+{
+    const UINT32 sets = opts.cache_size * KILO / (opts.line_size * opts.associativity);
+    if (!IsPower2(opts.shards) || opts.shards > sets || sets / opts.shards > ITLB::max_sets){
+        cerr << "-shards must be a power of two of at most " << sets << " and at least "
+             << (sets + ITLB::max_sets - 1) / ITLB::max_sets << endl;
+        return 1;
+    }
+    if (opts.thread_order != "" || opts.roi_start || opts.roi_length ||
+        opts.sampling.period || opts.interval){
+        cerr << "-shards only selects threads with -tid" << endl;
+        return 1;
+    }
+    const std::vector<UINT32> tids = ParseNumberList(opts.threads);
+
+    SHARDED_IL1 cache("L1 Inst Cache", opts.cache_size * KILO, opts.line_size, opts.associativity,
+                      opts.shards, SHARD_RING_RECORDS, YieldThread);
+    std::vector<shard_worker> workers(opts.shards);
+    std::vector<pthread_t> threads(opts.shards);
+    for (UINT32 i = 0; i < opts.shards; i++){
+        workers[i].cache = &cache;
+        workers[i].shard = i;
+        if (pthread_create(&threads[i], NULL, RunShard, &workers[i]) != 0){
+            cerr << "Could not start shard " << i << endl;
+            return 1;
+        }
+    }
+
+    fetch_record * records = new fetch_record[REPLAY_BUFFER_RECORDS];
+    size_t count;
+    UINT64 fetches = 0;
+    while ((count = input.Read(records, REPLAY_BUFFER_RECORDS)) != 0){
+        for (size_t i = 0; i < count; i++){
+            const fetch_record & record = records[i];
+            if (!(record.flags & FETCH_FLAG_EXECUTED))
+                continue;
+            if (opts.threads != "all" && std::find(tids.begin(), tids.end(), record.tid) == tids.end())
+                continue;
+            const bool single = (record.size <= 4) || (record.kind == FETCH_KIND_SYSCALL);
+            cache.Access(record.addr, single ? 1 : record.size);
+            fetches++;
+        }
+    }
+    delete [] records;
+    if (input.Failed())
+        cerr << "Corrupt chunk in fetch trace " << opts.trace << ", replayed up to it" << endl;
+
+    cache.Finish();
+    for (UINT32 i = 0; i < opts.shards; i++)
+        pthread_join(threads[i], NULL);
+    cache.Collect();
+
+    if (opts.format != STATS_WRITER::FORMAT_TEXT){
+        STATS_WRITER writer;
+        if (!writer.Open(opts.output.c_str(), opts.format)){
+            cerr << "Could not open report " << opts.output << endl;
+            return 1;
+        }
+        static const char * const cache_fields[] = {
+            "size", "line_size", "associativity", "shards", "load_hits", "load_misses"
+        };
+        writer.Section("sharded_cache", true, cache_fields, 6);
+        const uint64_t values[] = {
+            cache.CacheSize(), cache.LineSize(), cache.Associativity(), cache.Shards(),
+            cache.Hits(CACHE_BASE::ACCESS_TYPE_LOAD), cache.Misses(CACHE_BASE::ACCESS_TYPE_LOAD)
+        };
+        writer.Record(cache.Name(), values);
+    }
+    else {
+        std::ofstream out(opts.output.c_str());
+        out << "#\n# Sharded ICACHE stats (" << cache.Shards() << " shards)\n#\n";
+        out << cache.StatsLong("# ", CACHE_BASE::CACHE_TYPE_ICACHE);
+    }
+    cerr << "replayed " << fetches << " fetches on " << opts.shards << " shards" << endl;
+    return 0;
+}
+
+int main(int argc, char * argv[])
+{
+    replay_options opts;
+    if (!ParseOptions(argc, argv, opts))
+        return Usage(argv[0]);
+
+    FETCH_TRACE_READER reader;
+    if (!reader.Open(opts.trace)){
+        cerr << "Could not open fetch trace " << opts.trace << endl;
+        return 1;
+    }
+    if (opts.seek && !reader.Seek(opts.seek)){
+        cerr << "Could not seek to record " << opts.seek << " of " << reader.Records() << endl;
+        return 1;
+    }
+    TRACE_INPUT input(reader, opts.decoders);
+    if (opts.shards)
+        return ReplaySharded(input, opts);
+
+    icache_config config;
+    config.il1_size = opts.cache_size * KILO;
+    config.il1_line_size = opts.line_size;
+    config.il1_associativity = opts.associativity;
+    config.itlb_size = opts.itlb_size * KILO;
+    config.itlb_line_size = opts.itlb_line_size;
+    config.itlb_associativity = opts.itlb_associativity;
+    config.l2_size = opts.l2_size * KILO;
+    config.l2_line_size = opts.l2_line_size;
+    config.l2_associativity = opts.l2_associativity;
+    config.llc_size = opts.llc_size * KILO;
+    config.llc_line_size = opts.llc_line_size;
+    config.llc_associativity = opts.llc_associativity;
+    config.inclusion = opts.inclusion;
+    config.tlb = opts.tlb;
+    config.timing = opts.timing;
+    config.prefetch = opts.prefetch;
+    config.sampling = opts.sampling;
+    config.sweep_sizes = opts.sweep_sizes;
+    config.sweep_associativities = opts.sweep_associativities;
+    config.sweep_line_sizes = opts.sweep_line_sizes;
+    config.approximate_footprint = opts.approximate_footprint;
+    //traces carry no symbols, functions are always followed through calls
+    config.symbol_functions = false;
+    config.function_names = NULL;
+    config.call_stack_depth = opts.call_stack_depth;
+    config.profile_period = opts.profile;
+
+    std::ofstream interval_out;
+    const UINT64 first_interval = opts.interval ? opts.interval : ~UINT64(0);
+    if (opts.interval){
+        if (opts.interval_output.empty())
+            opts.interval_output = opts.output + ".intervals";
+        interval_out.open(opts.interval_output.c_str());
+        if (!interval_out){
+            cerr << "Could not open interval file " << opts.interval_output << endl;
+            return 1;
+        }
+        ICACHE_SIM::WriteIntervalHeader(interval_out);
+    }
+
+    //threads listed on the command line are created up front, with "all"
+    //every thread gets its own simulator on its first record. Threads
+    //selected by creation order are numbered by their first record.
+    const std::vector<UINT32> thread_order = ParseNumberList(opts.thread_order);
+    const bool all_threads = (opts.threads == "all") && thread_order.empty();
+    map<UINT32, replay_thread> threads;
+    map<UINT32, UINT32> first_seen;
+    if (opts.threads != "all"){
+        std::vector<UINT32> tids = ParseNumberList(opts.threads);
+        for (UINT32 i = 0; i < tids.size(); i++){
+            StartThread(threads[tids[i]], config, first_interval);
+        }
+    }
+
+    //the region of interest opens for all threads when the first one has
+    //skipped roi_start records, and ends the replay when the first one has
+    //replayed roi_length records
+    bool roi_open = (opts.roi_start == 0);
+    const UINT64 roi_stop_icount = opts.roi_length ? opts.roi_length : ~UINT64(0);
+
+    //same order as the pintool: the instruction is counted (and the report
+    //written at the threshold) before its fetch is simulated.
+    fetch_record * records = new fetch_record[REPLAY_BUFFER_RECORDS];
+    size_t count;
+    bool roi_closed = false;
+    while (!roi_closed && (count = input.Read(records, REPLAY_BUFFER_RECORDS)) != 0){
+        for (size_t i = 0; i < count && !roi_closed; i++){
+            const fetch_record & record = records[i];
+            if (!thread_order.empty() && first_seen.find(record.tid) == first_seen.end()){
+                const UINT32 order = first_seen.size();
+                first_seen[record.tid] = order;
+                if (threads.find(record.tid) == threads.end() &&
+                    std::find(thread_order.begin(), thread_order.end(), order) != thread_order.end())
+                    StartThread(threads[record.tid], config, first_interval);
+            }
+            map<UINT32, replay_thread>::iterator it = threads.find(record.tid);
+            if (it == threads.end()){
+                if (!all_threads)
+                    continue;
+                it = threads.insert(std::make_pair(record.tid, replay_thread())).first;
+                StartThread(it->second, config, first_interval);
+            }
+            replay_thread & thread = it->second;
+            if (!roi_open){
+                if (thread.skipped < opts.roi_start){
+                    thread.skipped++;
+                    continue;
+                }
+                roi_open = true;
+            }
+            if (thread.icount == roi_stop_icount){
+                roi_closed = true;
+                break;
+            }
+            if (thread.icount == INSTRUCTION_THRESHOLD){
+                WriteReport(*thread.sim, ThreadReportName(opts, record.tid), opts.format);
+                thread.reported = true;
+            }
+            if (thread.icount == thread.next_interval){
+                thread.sim->WriteInterval(interval_out, record.tid, thread.icount, false);
+                thread.next_interval += opts.interval;
+            }
+            if (thread.icount == thread.schedule.NextChange())
+                thread.sim->ChangePhase(thread.schedule);
+            thread.icount++;
+            if (record.flags & FETCH_FLAG_EXECUTED)
+                thread.sim->Fetch(record.addr, record.size, (FETCH_KIND)record.kind, thread.schedule.Phase());
+        }
+    }
+    delete [] records;
+    if (input.Failed())
+        cerr << "Corrupt chunk in fetch trace " << opts.trace << ", replayed up to it" << endl;
+
+    //threads shorter than the threshold are reported at their end, and all
+    //threads together in the merged report
+    ICACHE_SIM merged(config);
+    for (map<UINT32, replay_thread>::iterator it = threads.begin(); it != threads.end(); ++it){
+        replay_thread & thread = it->second;
+        thread.sim->EndStream(thread.schedule, thread.icount);
+        if (!thread.reported)
+            WriteReport(*thread.sim, ThreadReportName(opts, it->first), opts.format);
+        if (opts.interval)
+            thread.sim->WriteInterval(interval_out, it->first, thread.icount, true);
+        merged.Merge(*thread.sim);
+        cerr << "replayed " << thread.icount << " instructions of thread " << it->first << endl;
+        delete thread.sim;
+    }
+    WriteReport(merged, opts.output, opts.format);
+    return 0;
+}